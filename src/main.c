@@ -1,9 +1,15 @@
+// headless builds (-DHEADLESS) leave SDL out: no window, sound or keyboard, just the machine
+#ifndef HEADLESS
 #include "include/SDL2/SDL.h"
+#include <stdatomic.h>
+#endif // HEADLESS
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <errno.h>
 //#include <sys/time.h>
 #include <sys/timeb.h>
 //#include <unistd.h>
@@ -12,42 +18,153 @@
 #include <Windows.h>
 #endif // _WIN32_
 
+// x86 builds get AVX2 versions of the hot loops, picked at runtime if the CPU supports them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// the dynarec engine writes x86-64 machine code, so it only exists on x86-64 GCC/Clang builds
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_DYNAREC
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif // _WIN32
+#include <stddef.h>
+#endif
+
 int SCREEN_WIDTH;
 int SCREEN_HEIGHT;
 
 char *rom_path;
+char *aot_output_path; // set by --aot-emit, the ROM is written out as C there instead of being run
 
-int RAM_SIZE;
-int VRAM_SIZE; // vram size in bytes
-int VRAM_START_BYTE; // the byte in emu_ram where vram starts
+int RAM_SIZE; // must be a power of two, addresses wrap around at the end of emu_ram
+int RAM_ADDRESS_MASK;
 int FONT_START_BYTE; // the byte in emu_ram where font data starts
 
 int FPS; // frames per second (when FPS is unhooked)
 int IPS; // number of chip8 instructions per second
 int TIMER_FREQUENCY; // number of times the timers decrement in a second
-int UNHOOK_FPS; // when set to 1, refreshes the screen FPS times per second instead of every draw/clear command
+int UNHOOK_FPS; // when set to 1, the screen is presented at most FPS times per second instead of once per host refresh
+int ENSEMBLE_SIZE; // when above 0, that many copies of the ROM run without a window (see run_ensemble_mode())
+int RUN_FRAMES; // how many frames a run lasts, 0 for until the window is closed (a minute of emulated time without one)
+uint64_t RUN_INSTRUCTIONS; // when above 0, a --bench run stops after that many instructions instead of after RUN_FRAMES
+int BENCH_MODE; // when set to 1, the ROM runs without a window as fast as it can and the speed is printed (see run_bench_mode())
+char *key_script_path; // set by --keys, key presses and releases are read from there (see load_key_script())
+char *wav_path; // set by --wav, the beeper is written there as a WAV file (see write_wav_frame())
+double SPEED; // how many times faster than real time emulated time runs, 0 for as fast as the host can go
+double FAST_FORWARD_SPEED; // the same while TAB is held down
+int GOVERNOR; // when set to 1, IPS is tuned to the ROM as it runs (see govern_ips())
+int GOVERNOR_MIN_IPS; // the range the governor keeps IPS in
+int GOVERNOR_MAX_IPS;
+int AUDIO_BUFFER_SAMPLES; // samples in the audio device's buffer, smaller is less latency but more risk of running dry
+
+// the engines that can run the instructions (all give identical results)
+#define ENGINE_SWITCH 0 // one switch on the decoded operation
+#define ENGINE_THREADED 1 // threaded code using computed goto (GCC/Clang only)
+#define ENGINE_DYNAREC 2 // translates blocks of instructions into x86-64 machine code (x86-64 GCC/Clang only)
+#define ENGINE_AOT 3 // a ROM compiled to C with --aot-emit, built in with -DAOT_SOURCE (the default in those builds)
+
+// build with -DDEFAULT_ENGINE=ENGINE_THREADED to change the default, or pick one with --engine
+#ifndef DEFAULT_ENGINE
+#ifdef AOT_SOURCE
+#define DEFAULT_ENGINE ENGINE_AOT
+#else
+#define DEFAULT_ENGINE ENGINE_SWITCH
+#endif // AOT_SOURCE
+#endif
+int ENGINE = DEFAULT_ENGINE;
+const char *engine_names[] = {"switch", "threaded", "dynarec", "aot"}; // indexed by ENGINE
 
 uint32_t *palette; // RGBA values for the two screen colours
 
-uint8_t *emu_ram;
+uint64_t display_row_mask; // the bits of a display row word that are on screen
 
 int emu_stack_max;
-uint16_t *emu_stack;
-int emu_stack_top;
 
 int PROGRAM_START_BYTE; // the emu_ram address where the program is loaded and started from
-uint16_t PC;
-
-uint8_t delay_timer;
-uint8_t sound_timer;   // sound not implimented
-
-uint16_t I;
-
-uint8_t *V;
 
+// quirk settings new machines start with
 int COPY_SHIFT = 0; // defines if VY should be copied to VX before a shift instruction
 int JUMP_OFFSET_MODE = 0; // defines whether to use the old behavior (0) or new behaviour (1) for the BNNN instruction
 int LOAD_STORE_MODE = 1; // defines whether to use the old behavior (0) or new behavior (1) for the FX55 and FX65 instructions
+int SPRITE_WRAP = 0; // defines whether sprites are clipped (0) or wrap around to the other side (1) at the screen edges
+
+// The quirks and sizes the interpreter depends on. Every machine carries its own copy, taken from
+// the settings above when it is created. The switch engine is also built once for each of the
+// usual profiles with the values as constants, so those builds have no quirk checks left in them
+// and the sizes fold into the masks and bounds (see run_instructions_switch()).
+typedef struct Chip8Profile {
+    uint8_t copy_shift; // see COPY_SHIFT
+    uint8_t jump_offset_mode; // see JUMP_OFFSET_MODE
+    uint8_t load_store_mode; // see LOAD_STORE_MODE
+    uint8_t sprite_wrap; // see SPRITE_WRAP
+    int screen_width;
+    int screen_height;
+    int ram_size;
+    int stack_size;
+} Chip8Profile;
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define NOINLINE __attribute__((noinline))
+#else
+#define ALWAYS_INLINE inline
+#define NOINLINE
+#endif // __GNUC__
+
+// an instruction split into its operation (one of the OP_ values) and operands
+typedef struct DecodedInstruction {
+    uint8_t op;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t N;
+    uint8_t NN;
+    uint16_t NNN;
+    uint16_t instruction; // the original two bytes, for error messages
+    uint8_t touches_vf; // reads or writes VF, so any flag still owed to it has to be worked out first
+} DecodedInstruction;
+
+// Everything one emulated Chip8 needs. Nothing in here is shared between machines, so any number
+// of them can run side by side, on different threads if need be. The registers the interpreter
+// touches on every instruction come first so they sit together in the first cache line.
+typedef struct Chip8Machine {
+    _Alignas(64) uint8_t V[16];
+    uint16_t PC;
+    uint16_t I;
+    int8_t emu_stack_top;
+    uint8_t get_key_status; // decides what should be accessing the get_key_key variable
+                            // 0 - not in use
+                            // 1 - input detection should be deciding what key is being pressed
+                            // 2 - a key has been pressed since the get key instruction was started and the instruction should now read the get_key_key variable
+    int8_t get_key_key; // the keypad id used in the get key instruction. <0 means not valid, 0-15 are the keypad values
+    uint32_t random_state; // xorshift state for the random instruction (rand() is shared by the whole process)
+    uint8_t flag_kind; // the flag VF is owed by the last 8XY4/5/6/7/E, one of the FLAG_ values (see materialize_vf())
+    uint8_t flag_a; // the operands that flag is worked out from
+    uint8_t flag_b;
+
+    uint8_t *emu_ram;
+    uint64_t *display_rows; // the screen, one word per row with the leftmost pixel in the top bit (so SCREEN_WIDTH can be at most 64)
+    uint64_t dirty_rows; // rows changed since the last present (bit n is row n), the screen is redrawn at the next frame boundary
+    uint16_t *emu_stack;
+    DecodedInstruction *decoded; // one slot per emu_ram address, filled in the first time that address runs
+    uint64_t fused_instructions; // how many instructions have run as part of a superinstruction, for the stats
+    uint64_t idle_instructions; // how many were passed over in idle loops (see skip_idle_loop()), also for the stats
+    uint64_t timer_polls; // delay timer reads (FX07), for the governor (see govern_ips())
+    uint64_t draw_count; // sprites drawn, also for the governor
+    uint64_t timer_ticks; // how many times the timers have ticked, the emulated time they go by (see advance_timers())
+    uint64_t delay_timer_end; // the tick the delay timer reaches 0 at
+    uint64_t sound_timer_end; // the tick the sound timer reaches 0 at, the beeper sounds until then (see update_beeper())
+    const uint8_t *translated; // nonzero for each emu_ram byte the dynarec or aot engine compiled, NULL if neither has run
+    uint8_t code_modified; // a store hit compiled code, the dynarec throws its blocks away and the aot engine stops being used
+    struct Chip8Dynarec *dynarec; // the dynarec's code cache, made the first time it runs this machine
+
+    uint8_t keypad_states[16]; // the up/down states of the 16 keys on the chip8 keypad (0 is up, 1 is down)
+
+    Chip8Profile profile; // quirks and sizes, copied from the settings above when the machine is created
+    uint64_t (*switch_engine)(struct Chip8Machine *m, uint64_t count); // the build of the switch engine for that profile, picked the first time it runs
+} Chip8Machine;
 
 static uint8_t font[80] = {
   0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -73,121 +190,179 @@ void initialize_settings() {
     SCREEN_HEIGHT = 32;
 
     RAM_SIZE = 4096;
-    VRAM_SIZE =  (SCREEN_WIDTH * SCREEN_HEIGHT / 8);
-    VRAM_START_BYTE = 0xF00;
+    RAM_ADDRESS_MASK = RAM_SIZE - 1;
     FONT_START_BYTE = 0x050;
 
     FPS = 60;
     IPS = 700;
     TIMER_FREQUENCY = 60;
     UNHOOK_FPS = 0;
+    ENSEMBLE_SIZE = 0;
+    RUN_FRAMES = 0;
+    RUN_INSTRUCTIONS = 0;
+    BENCH_MODE = 0;
+    AUDIO_BUFFER_SAMPLES = 256;
+    SPEED = 1;
+    FAST_FORWARD_SPEED = 0;
+    GOVERNOR = 0;
+    GOVERNOR_MIN_IPS = 200;
+    GOVERNOR_MAX_IPS = 100000;
 
     palette = malloc(sizeof(uint32_t) * 2);
     palette[0] = 0x000000FF;
     palette[1] = 0xFFFF00FF;
 
-    emu_ram = malloc(sizeof(uint8_t) * RAM_SIZE);
+    display_row_mask = ~(uint64_t)0 << (64 - SCREEN_WIDTH);
 
     emu_stack_max = 16;
-    emu_stack = malloc(sizeof(uint16_t) * emu_stack_max);
-    emu_stack_top = -1;
 
     PROGRAM_START_BYTE = 0x200;
-    PC = PROGRAM_START_BYTE;
+}
+
+// allocate a machine in its power-on state, using the current settings
+Chip8Machine *create_machine() {
+#ifdef _WIN32
+    Chip8Machine *m = _aligned_malloc(sizeof(Chip8Machine), 64);
+#else
+    Chip8Machine *m = aligned_alloc(64, sizeof(Chip8Machine));
+#endif // _WIN32
+    memset(m, 0, sizeof(Chip8Machine));
+
+    m->emu_ram = calloc(RAM_SIZE, sizeof(uint8_t));
+    m->decoded = calloc(RAM_SIZE, sizeof(DecodedInstruction));
+
+    m->display_rows = calloc(SCREEN_HEIGHT, sizeof(uint64_t));
+    m->dirty_rows = (SCREEN_HEIGHT == 64) ? ~(uint64_t)0 : ((uint64_t)1 << SCREEN_HEIGHT) - 1; // the first present uploads everything
+
+    m->emu_stack = malloc(sizeof(uint16_t) * emu_stack_max);
+    m->emu_stack_top = -1;
+
+    m->PC = PROGRAM_START_BYTE;
+
+    m->timer_ticks = 0;
+    m->delay_timer_end = 255;
+    m->sound_timer_end = 0; // not 255 like the delay timer, that would beep for the first 4 seconds
 
-    delay_timer = 255;
-    sound_timer = 255;
+    m->get_key_key = -1;
+    m->random_state = 0x2545F491;
 
-    V = malloc(sizeof(uint16_t) * 16);
+    m->profile.copy_shift = COPY_SHIFT;
+    m->profile.jump_offset_mode = JUMP_OFFSET_MODE;
+    m->profile.load_store_mode = LOAD_STORE_MODE;
+    m->profile.sprite_wrap = SPRITE_WRAP;
+    m->profile.screen_width = SCREEN_WIDTH;
+    m->profile.screen_height = SCREEN_HEIGHT;
+    m->profile.ram_size = RAM_SIZE;
+    m->profile.stack_size = emu_stack_max;
+    return m;
 }
 
+#ifdef HAVE_DYNAREC
+void destroy_dynarec(struct Chip8Dynarec *dyn);
+#endif // HAVE_DYNAREC
+
+void destroy_machine(Chip8Machine *m) {
+#ifdef HAVE_DYNAREC
+    if (m->dynarec != NULL) {
+        destroy_dynarec(m->dynarec);
+    }
+#endif // HAVE_DYNAREC
+    free(m->emu_ram);
+    free(m->decoded);
+    free(m->display_rows);
+    free(m->emu_stack);
+#ifdef _WIN32
+    _aligned_free(m);
+#else
+    free(m);
+#endif // _WIN32
+}
+
+#ifndef HEADLESS
 SDL_Texture *screen_tex; // SDL texture that holds the contents of the screen
-uint8_t *screen_pixels; // array of screen pixels used to build screen_tex
 SDL_Renderer* screen_ren; // main SLD renderer
+bool redraw_requested = false; // the window needs presenting again even though no rows changed (e.g. it was uncovered)
+uint64_t present_interval; // shortest time between two screen refreshes (one host display refresh)
+#endif // HEADLESS
 
-uint8_t *previous_keyboard;
-uint8_t *current_keyboard;
 
-uint8_t keypad_states[16] = {0}; // the up/down states of the 16 keys on the chip8 keypad (0 is up, 1 is down)
-uint8_t get_key_status = 0; // decides what should be accessing the get_key_key variable
-                            // 0 - not in use
-                            // 1 - input detection should be deciding what key is being pressed
-                            // 2 - a key has been pressed since the get key instruction was started and the instruction should now read the get_key_key variable
-int get_key_key = -1; // the keypad id used in the get key instruction. <0 means not valid, 0-15 are the keypad values
 
+// The timers count down by one every tick, TIMER_FREQUENCY ticks a second. Rather than counting
+// them down, each one is kept as the tick it reaches 0 at and its value is only worked out when
+// something reads it (FX07, the idle loop checks, the beeper). Setting one is just as cheap, and
+// time passing is one addition however many ticks go by.
+static inline uint8_t get_delay_timer(const Chip8Machine *m) {
+  return (m->delay_timer_end > m->timer_ticks) ? (uint8_t)(m->delay_timer_end - m->timer_ticks) : 0;
+}
 
-static void update_timers() {
-  if (delay_timer > 0) {
-    delay_timer -= 1;
-  }
-  if (sound_timer > 0) {
-    sound_timer -= 1;
-  }
+static inline uint8_t get_sound_timer(const Chip8Machine *m) {
+  return (m->sound_timer_end > m->timer_ticks) ? (uint8_t)(m->sound_timer_end - m->timer_ticks) : 0;
+}
+
+static inline void set_delay_timer(Chip8Machine *m, uint8_t value) {
+  m->delay_timer_end = m->timer_ticks + value;
+}
+
+static inline void set_sound_timer(Chip8Machine *m, uint8_t value) {
+  m->sound_timer_end = m->timer_ticks + value;
+}
+
+// the timers tick at the end of every frame. frame boundaries sit at fixed instruction counts, so
+// they follow emulated time rather than whenever the host got round to it
+static inline void advance_timers(Chip8Machine *m, uint64_t ticks) {
+  m->timer_ticks += ticks;
 }
 
-static uint16_t emu_stack_peek() {
-  if (emu_stack_top < 0) {
+static uint16_t emu_stack_peek(Chip8Machine *m) {
+  if (m->emu_stack_top < 0) {
     // stack empty
     printf("emu_stack empty read\n");
     return 0;
   }
   else {
-    return emu_stack[emu_stack_top];
+    return m->emu_stack[m->emu_stack_top];
   }
 }
 
-static uint16_t emu_stack_pop() {
-  if (emu_stack_top < 0) {
+static uint16_t emu_stack_pop(Chip8Machine *m) {
+  if (m->emu_stack_top < 0) {
     // stack empty
     printf("emu_stack empty pop\n");
     return 0;
   }
   else {
-    uint16_t top_value = emu_stack[emu_stack_top];
-    emu_stack_top -= 1;
+    uint16_t top_value = m->emu_stack[m->emu_stack_top];
+    m->emu_stack_top -= 1;
     return top_value;
   }
 }
 
-static void emu_stack_push(uint16_t value) {
-  if (emu_stack_top >= emu_stack_max - 1) {
+static inline void emu_stack_push(Chip8Machine *m, uint16_t value, int stack_size) {
+  if (m->emu_stack_top >= stack_size - 1) {
     // stack full
     printf("emu_stack full\n");
   }
   else{
-    emu_stack_top += 1;
-    emu_stack[emu_stack_top] = value;
+    m->emu_stack_top += 1;
+    m->emu_stack[m->emu_stack_top] = value;
   }
   
 }
 
-uint16_t reverse16(uint16_t value) {
-  return ((value & 0x00FF) << 8) | ((value & 0xFF00) >> 8);
-}
-
-uint16_t get_emu_ram_pixel_byte(uint16_t x, uint16_t y) {
-  return (y * (SCREEN_WIDTH / 8)) + (x / 8) + VRAM_START_BYTE;
-}
-
-uint16_t get_emu_ram_pixel_byte_offset(uint16_t x) {
-  return 7 - (x % 8);
-}
-
-uint16_t get_emu_ram_pixel(uint16_t ram_byte_index, uint16_t offset) {
-  return (emu_ram[ram_byte_index] >> offset) & 1;
+// next value from the machine's own random number generator (xorshift32)
+static uint8_t next_random(Chip8Machine *m) {
+  uint32_t x = m->random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  m->random_state = x;
+  return (uint8_t)(x >> 24);
 }
 
-void set_emu_ram_pixel(uint16_t ram_byte_index, uint16_t offset, bool value) {
-  if (value == true) {
-    emu_ram[ram_byte_index] |= 1UL << offset;
-  }
-  else {
-    emu_ram[ram_byte_index] &= ~(1UL << offset);
-  }
+uint16_t reverse16(uint16_t value) {
+  return ((value & 0x00FF) << 8) | ((value & 0xFF00) >> 8);
 }
 
-void draw_frame();
-
 /* Size of each input chunk to be
    read and allocate for. */
 #ifndef  READALL_CHUNK
@@ -271,617 +446,3687 @@ int readall(FILE *in, char **dataptr, size_t *sizeptr)
     return READALL_OK;
 }
 
-static void initialize_emu_ram() {
-    //emu_ram[VRAM_START_BYTE] = 0b11111111;
-    //emu_ram[VRAM_START_BYTE + 1] = 0b00001111;
-    //emu_ram[VRAM_START_BYTE] = 0b10000000;
-    //emu_ram[VRAM_START_BYTE + 7] = 0b10000001;
-    //emu_ram[VRAM_START_BYTE + 15] = 0b10000001;
-    //emu_ram[VRAM_START_BYTE + VRAM_SIZE - 1] = 0b10000001;
-
-    // for (int i = 0; i < VRAM_SIZE; i++) {
-    //     emu_ram[VRAM_START_BYTE + i] = 0b11111111;
-    // }
-
-    // emu_ram[VRAM_START_BYTE + 15] = 0b10000001;
-
-    // load font
-    memcpy(&emu_ram[FONT_START_BYTE], &font, 80*sizeof(*font));
-}
-
-// load rom file into emu_ram
-void load_rom(char *rom) {
-    FILE *rom_file = fopen(rom, "rb");
-    char *rom_data;
-    size_t rom_size = 0;
-    int suc = readall(rom_file, &rom_data, &rom_size);
-    //printf("Rom size: %d\n", rom_size);
-    //printf("Rom status: %d\n", suc);
-    memcpy(&emu_ram[PROGRAM_START_BYTE], rom_data, rom_size);
-}
-
-// runs one Chip8 instruction at the current PC
-void run_next_instruction() {
-  // fetch (CAREFUL: CHIP8 is big endian C is little endian)
-  uint8_t byte1 = emu_ram[PC];
-  uint8_t byte2 = emu_ram[PC + 1];
-  //uint16_t instruction = (byte2 << 8) | byte1;
-  uint16_t instruction = (byte1 << 8) | byte2;
-  PC += 2;
-
-  //printf("Instruction: %d\n", instruction);
+// Decoded instructions
+//
+// Every emu_ram address has a slot in the machine's decoded cache. The first time an address runs,
+// its two bytes are split into an operation and its operands, and after that the instruction runs
+// straight from the cache. Writes to emu_ram go through write_emu_ram() so an instruction that is
+// overwritten (self-modifying code) gets decoded again.
+
+// the operations an instruction can decode to
+enum {
+  OP_UNDECODED = 0, // the slot hasn't been decoded yet (or was invalidated by a write)
+  OP_INVALID,
+  OP_NOP,           // 8XYN and FXNN with an unknown N/NN did nothing before decoding was cached either
+  OP_CLEAR,         // 00E0
+  OP_RETURN,        // 00EE
+  OP_JUMP,          // 1NNN
+  OP_CALL,          // 2NNN
+  OP_SKIP_EQ_NN,    // 3XNN
+  OP_SKIP_NE_NN,    // 4XNN
+  OP_SKIP_EQ_VY,    // 5XY0
+  OP_SET_NN,        // 6XNN
+  OP_ADD_NN,        // 7XNN
+  OP_SET_VY,        // 8XY0
+  OP_OR,            // 8XY1
+  OP_AND,           // 8XY2
+  OP_XOR,           // 8XY3
+  OP_ADD_VY,        // 8XY4
+  OP_SUB_VY,        // 8XY5
+  OP_SHIFT_RIGHT,   // 8XY6
+  OP_SUB_FROM_VY,   // 8XY7
+  OP_SHIFT_LEFT,    // 8XYE
+  OP_SKIP_NE_VY,    // 9XY0
+  OP_SET_I,         // ANNN
+  OP_JUMP_OFFSET,   // BNNN
+  OP_RANDOM,        // CXNN
+  OP_DRAW,          // DXYN
+  OP_SKIP_KEY,      // EX9E
+  OP_SKIP_NOT_KEY,  // EXA1
+  OP_GET_DELAY,     // FX07
+  OP_GET_KEY,       // FX0A
+  OP_SET_DELAY,     // FX15
+  OP_SET_SOUND,     // FX18
+  OP_ADD_I,         // FX1E
+  OP_FONT,          // FX29
+  OP_BCD,           // FX33
+  OP_STORE,         // FX55
+  OP_LOAD,          // FX65
+  OP_IDLE_JUMP,     // 1NNN jumping to itself (set by fuse_instructions(), but only ever one instruction)
+
+  // superinstructions, see fuse_instructions()
+  OP_SET_I_DRAW,    // ANNN DXYN
+  OP_SET_NN_PAIR,   // 6XNN 6YNN
+  OP_COUNT_LOOP,    // 7XKK 3XNN 1NNN
+  OP_DELAY_WAIT,    // FX07 3XNN 1NNN
+  OP_COUNT
+};
+#define OP_FIRST_FUSED OP_SET_I_DRAW
+#define MAX_FUSED_LENGTH 3 // a fused op only runs when the budget has room for this many instructions
+
+// split an instruction into its operation and operands
+static DecodedInstruction decode_instruction(uint16_t instruction) {
+  DecodedInstruction d;
+  d.instruction = instruction;
+  d.X = (instruction & 0b0000111100000000) >> 8;
+  d.Y = (instruction & 0b0000000011110000) >> 4;
+  d.N = instruction & 0b0000000000001111;
+  d.NN = instruction & 0b0000000011111111;
+  d.NNN = instruction & 0b0000111111111111;
+  d.op = OP_INVALID;
 
   // decode
-  //uint16_t opcode = (instruction & 0b0000000011110000) >> 4;
   uint16_t opcode = (instruction & 0b1111000000000000) >> 12;
 
   switch(opcode) {
     case 0x0:
-    {
       if (instruction == 0x00E0) {
-        // Clear screen
-        for (int i = 0; i < VRAM_SIZE; i++) {
-          emu_ram[VRAM_START_BYTE + i] = 0;
-        }
-        if (UNHOOK_FPS == 0) {
-          draw_frame();
-        }
+        d.op = OP_CLEAR;
       }
       else if (instruction == 0x00EE) {
-        // Return
-        uint16_t NNN = emu_stack_pop();
-        PC = NNN;
+        d.op = OP_RETURN;
       }
-      else {
-        printf("Invalid instruction %d\n", instruction);
-      }
-      break;
-    }
-    case 0x1:
-    {
-      // Jump
-      uint16_t NNN = instruction & 0b0000111111111111;
-      PC = NNN;
-      break;
-    }
-    case 0x2:
-    {
-      // Subroutine
-      uint16_t NNN = instruction & 0b0000111111111111;
-      emu_stack_push(PC);
-      PC = NNN;
       break;
-    }
-    case 0x3:
+    case 0x1: d.op = OP_JUMP; break;
+    case 0x2: d.op = OP_CALL; break;
+    case 0x3: d.op = OP_SKIP_EQ_NN; break;
+    case 0x4: d.op = OP_SKIP_NE_NN; break;
+    case 0x5: d.op = OP_SKIP_EQ_VY; break;
+    case 0x6: d.op = OP_SET_NN; break;
+    case 0x7: d.op = OP_ADD_NN; break;
+    case 0x8:
     {
-      // Jump if equal
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
-      if (V[X] == NN) {
-        PC += 2;
+      switch(d.N) {
+        case 0x0: d.op = OP_SET_VY; break;
+        case 0x1: d.op = OP_OR; break;
+        case 0x2: d.op = OP_AND; break;
+        case 0x3: d.op = OP_XOR; break;
+        case 0x4: d.op = OP_ADD_VY; break;
+        case 0x5: d.op = OP_SUB_VY; break;
+        case 0x6: d.op = OP_SHIFT_RIGHT; break;
+        case 0x7: d.op = OP_SUB_FROM_VY; break;
+        case 0xE: d.op = OP_SHIFT_LEFT; break;
+        default: d.op = OP_NOP; break;
       }
       break;
     }
-    case 0x4:
-    {
-      // Jump if not equal
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
-      if (V[X] != NN) {
-        PC += 2;
+    case 0x9: d.op = OP_SKIP_NE_VY; break;
+    case 0xA: d.op = OP_SET_I; break;
+    case 0xB: d.op = OP_JUMP_OFFSET; break;
+    case 0xC: d.op = OP_RANDOM; break;
+    case 0xD: d.op = OP_DRAW; break;
+    case 0xE:
+      if (d.NN == 0x9E) {
+        d.op = OP_SKIP_KEY;
       }
-      break;
-    }
-    case 0x5:
-    {
-      // Jump if equal
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint16_t Y = (instruction & 0b0000000011110000) >> 4;
-      if (V[X] == V[Y]) {
-        PC += 2;
+      else if (d.NN == 0xA1) {
+        d.op = OP_SKIP_NOT_KEY;
       }
       break;
-    }
-    case 0x6:
-    {
-      // Set Register
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
-      V[X] = NN;
-      break;
-    }
-    case 0x7:
-    {
-      // Add to Register
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
-      V[X] += NN;
-      break;
-    }
-    case 0x8:
+    case 0xF:
     {
-      // Logical and arithmetic instructions
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint16_t Y = (instruction & 0b0000000011110000) >> 4;
-      uint16_t N = instruction & 0b0000000000001111;
-      
-      switch(N) {
-        case 0x0:
-        {
-          // Set
-          V[X] = V[Y];
-          break;
-        }
-        case 0x1:
-        {
-          // Binary OR
-          V[X] = V[X] | V[Y];
-          break;
-        }
-        case 0x2:
-        {
-          // Binary AND
-          V[X] = V[X] & V[Y];
-          break;
-        }
-        case 0x3:
-        {
-          // Logical XOR
-          V[X] = V[X] ^ V[Y];
-          break;
-        }
-        case 0x4:
-        {
-          // Add (with overflow flag)
-          uint16_t temp = (uint16_t)V[X] + (uint16_t)V[X];
-          V[X] = V[X] + V[Y];
-          if (temp > 255) {
-            V[0xF] = 1;
-          }
-          else {
-            V[0xF] = 0;
-          }
-          break;
-        }
-        case 0x5:
-        {
-          // Subtract VX - VY (with overflow flag)
-          bool underflow = V[X] < V[Y];
-          V[X] = V[X] - V[Y];
-          if (!underflow) {
-            V[0xF] = 1;
-          }
-          else {
-            V[0xF] = 0;
-          }
-          break;
-        }
-        case 0x7:
-        {
-          // Subtract VY - VX (with overflow flag)
-          bool underflow = V[Y] < V[X];
-          V[X] = V[Y] - V[X];
-          if (!underflow) {
-            V[0xF] = 1;
-          }
-          else {
-            V[0xF] = 0;
-          }
-          break;
-        }
-        case 0x6:
-        {
-          // Right shift
-          if (COPY_SHIFT == 1) {
-            V[X] = V[Y];
-          }
-          bool shifted_1 = V[X] & 0b00000001;
-          V[X] = V[X] >> 1;
-          if (shifted_1) {
-            V[0xF] = 1;
-          }
-          else {
-            V[0xF] = 0;
-          }
-          break;
-        }
-        case 0xE:
-        {
-          // Left shift
-          if (COPY_SHIFT == 1) {
-            V[X] = V[Y];
-          }
-          bool shifted_1 = V[X] & 0b10000000;
-          V[X] = V[X] << 1;
-          if (shifted_1) {
-            V[0xF] = 1;
-          }
-          else {
-            V[0xF] = 0;
-          }
-          break;
-        }
+      switch(d.NN) {
+        case 0x07: d.op = OP_GET_DELAY; break;
+        case 0x0A: d.op = OP_GET_KEY; break;
+        case 0x15: d.op = OP_SET_DELAY; break;
+        case 0x18: d.op = OP_SET_SOUND; break;
+        case 0x1E: d.op = OP_ADD_I; break;
+        case 0x29: d.op = OP_FONT; break;
+        case 0x33: d.op = OP_BCD; break;
+        case 0x55: d.op = OP_STORE; break;
+        case 0x65: d.op = OP_LOAD; break;
+        default: d.op = OP_NOP; break;
       }
-
       break;
     }
-    case 0x9:
-    {
-      // Jump if not equal
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint16_t Y = (instruction & 0b0000000011110000) >> 4;
-      if (V[X] != V[Y]) {
-        PC += 2;
+  }
+  // register F as either operand, DXYN's collision flag and FX1E's overflow flag
+  d.touches_vf = d.X == 0xF || d.Y == 0xF || d.op == OP_DRAW || d.op == OP_ADD_I;
+  return d;
+}
+
+// the two bytes of the instruction at address (CAREFUL: CHIP8 is big endian C is little endian)
+static inline uint16_t fetch_instruction(Chip8Machine *m, uint16_t address) {
+  uint8_t byte1 = m->emu_ram[address];
+  uint8_t byte2 = m->emu_ram[(address + 1) & RAM_ADDRESS_MASK];
+  return (byte1 << 8) | byte2;
+}
+
+// Superinstructions. A few runs of instructions turn up in nearly every ROM (set I then draw, set
+// two registers, count and loop, wait for the delay timer), so when the first instruction of one is
+// decoded the whole run goes into its slot as a single op. The operands of the later instructions
+// are packed into the spare fields (see the op_ functions for the layout), and instruction keeps
+// the first one's bytes so it can still be run on its own. The slots of the later instructions
+// keep their own decodes, so a jump into the middle of a run works as before.
+static void fuse_instructions(Chip8Machine *m, uint16_t address) {
+  if (address + 6 > RAM_SIZE) {
+    return; // runs never wrap around the end of emu_ram
+  }
+  DecodedInstruction *d = &m->decoded[address];
+  DecodedInstruction second = decode_instruction(fetch_instruction(m, address + 2));
+  DecodedInstruction third = decode_instruction(fetch_instruction(m, address + 4));
+  uint8_t touches_vf = d->touches_vf | second.touches_vf | third.touches_vf; // kept for whatever gets fused
+
+  switch (d->op) {
+    case OP_SET_I:
+      if (second.op == OP_DRAW) {
+        d->op = OP_SET_I_DRAW;
+        d->X = second.X;
+        d->Y = second.Y;
+        d->N = second.N;
+        d->touches_vf = touches_vf;
       }
       break;
-    }
-    case 0xA:
-    {
-      // Set Index
-      uint16_t NNN = instruction & 0b0000111111111111;
-      I = NNN;
-      break;
-    }
-    case 0xB:   // untested
-    {
-      // Jump with offset
-      if (JUMP_OFFSET_MODE == 0) {
-        // Old way
-        uint16_t NNN = instruction & 0b0000111111111111;
-        PC = NNN + V[0x0];
-      }
-      else {
-        // New way
-        uint16_t X = (instruction & 0b0000111100000000) >> 8;
-        uint16_t XNN = instruction & 0b0000111111111111;
-        PC = XNN + V[X];
+    case OP_SET_NN:
+      if (second.op == OP_SET_NN) {
+        d->op = OP_SET_NN_PAIR;
+        d->Y = second.X;
+        d->NNN = second.NN;
+        d->touches_vf = touches_vf;
       }
       break;
-    }
-    case 0xC:   // untested
-    {
-      // Random
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
-      V[X] = (rand() % 255) & NN;
+    case OP_ADD_NN:
+    case OP_GET_DELAY:
+      if (second.op == OP_SKIP_EQ_NN && second.X == d->X && third.op == OP_JUMP) {
+        d->op = (d->op == OP_ADD_NN) ? OP_COUNT_LOOP : OP_DELAY_WAIT;
+        d->Y = d->NN;
+        d->NN = second.NN;
+        d->NNN = third.NNN;
+        d->touches_vf = touches_vf;
+      }
       break;
-    }
-    case 0xD:
-    {
-      // Display
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint16_t Y = (instruction & 0b0000000011110000) >> 4;
-      uint16_t N = instruction & 0b0000000000001111;
-
-      uint16_t coord_x = V[X] % SCREEN_WIDTH;
-      uint16_t coord_y = V[Y] % SCREEN_HEIGHT;
-      V[0xF] = 0;
-
-
-      for (int row = 0; row < N; row++) {
-        uint8_t sprite_byte = emu_ram[I + row];
-        for (uint8_t bit_offset = 0; bit_offset < 8; bit_offset++) {
-          if(sprite_byte >> (7 - bit_offset) & 0b00000001) {
-            // Spite bit is on so this bit should be flipped on screen
-            int x = coord_x + bit_offset;
-            int y = coord_y + row;
-            //APP_LOG(APP_LOG_LEVEL_DEBUG, "XCo: %d, YCo: %d", x, y);
-            if (x < SCREEN_WIDTH && y < SCREEN_HEIGHT) {
-              if(get_emu_ram_pixel(get_emu_ram_pixel_byte(x, y), get_emu_ram_pixel_byte_offset(x))) {
-                // Bit was already on. Flip off and set VF to 1
-                set_emu_ram_pixel(get_emu_ram_pixel_byte(x, y), get_emu_ram_pixel_byte_offset(x), 0);
-                V[0xF] = 1;
-              }
-              else {
-                // Bit was off. Flip on
-                set_emu_ram_pixel(get_emu_ram_pixel_byte(x, y), get_emu_ram_pixel_byte_offset(x), 1);
-              }
-            }
-          }
-        }
+    case OP_JUMP:
+      if (d->NNN == address) {
+        d->op = OP_IDLE_JUMP;
       }
+      break;
+  }
+}
 
+// decode the instruction at address into the machine's cache
+static void decode_address(Chip8Machine *m, uint16_t address) {
+  m->decoded[address] = decode_instruction(fetch_instruction(m, address));
+  fuse_instructions(m, address);
+}
 
-      if (UNHOOK_FPS == 0) {
-        draw_frame();
-      }
-
-      break;
-    }
-    case 0xE:   // untested
-    {
-      // Skip if key
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
+// every store into emu_ram goes through here. the cached decodes that read this byte are thrown
+// away: the instruction starting at it, the one starting the byte before (whose second half this
+// is), and any superinstruction starting up to 5 bytes before
+static inline void write_emu_ram(Chip8Machine *m, uint16_t address, uint8_t value) {
+  address &= RAM_ADDRESS_MASK;
+  m->emu_ram[address] = value;
+  for (int back = 0; back < MAX_FUSED_LENGTH * 2; back++) {
+    m->decoded[(address - back) & RAM_ADDRESS_MASK].op = OP_UNDECODED;
+  }
+  if (m->translated != NULL && m->translated[address]) {
+    m->code_modified = 1;
+  }
+}
 
-      if (V[X] > 0xF) {
-        printf("Warning: skip if key instuction requested invalid key number (crash likely)\n");
-      }
+// forget every cached decode (after emu_ram has been filled directly, e.g. by load_rom)
+static void invalidate_decoded(Chip8Machine *m) {
+  memset(m->decoded, 0, sizeof(DecodedInstruction) * RAM_SIZE);
+  m->code_modified = 1;
+}
 
-      if (NN == 0x9E) {
-        // Skip if key pressed
-        if(keypad_states[V[X]] == 1) {
-            PC += 2;
-        }
-      }
-      else if (NN == 0xA1) {
-        // skip if not pressed
-        if (keypad_states[V[X]] == 0) {
-            PC += 2;
-        }
-      }
-      else {
-        printf("Invalid if key instruction\n");
-      }
-      break;
-    }
-    case 0xF:
-    {
-      // Other functions
-      uint16_t X = (instruction & 0b0000111100000000) >> 8;
-      uint8_t NN = instruction & 0b0000000011111111;
-      switch(NN) {
-        // Timer Functions
-        case 0x07:  // untested
-        {
-          V[X] = delay_timer;
-          break;
-        }
-        case 0x15:  // untested
-        {
-          delay_timer = V[X];
-          break;
-        }
-        case 0x18:  // untested
-        {
-          sound_timer = V[X];
-          break;
-        }
-
-        // Index function
-        case 0x1E:  // untested
-        {
-          I += V[X];
-          // overflow out of address space sets VF to 1 (not the case on original hardware)
-          if (I >= 0x1000) {
-            V[0xF] = 1;
-          }
-          break;
-        }
+// The operations. Each one runs with PC already pointing at the next instruction. The ones that
+// depend on the quirks or sizes read them from a profile (the _with versions), the plain version
+// of those uses the machine's own.
 
-        // Get key function
-        case 0x0A:  // untested
-        {
-          if (get_key_status == 2) {    // key has been pressed
-            if (get_key_key < 0) {
-                printf("Tried to run Get key when no key was set\n");
-            }
-            else if (get_key_key > 0xF) {
-                printf("Tried to run Get key with an invalid key\n");
-            }
-            else {
-                // successfully got key
-                V[X] = get_key_key;
-                get_key_status = 0;
-            }
-          }
-          else if (get_key_status == 0) {
-            // Start waiting for key
-            get_key_status = 1;
-            PC -= 2;
-          }
-          else {
-            // Waiting for key press
-            PC -= 2;
-          }
-          break;
-        }
+static inline void op_invalid(Chip8Machine *m, const DecodedInstruction *d) {
+  printf("Invalid instruction %d\n", d->instruction);
+}
 
-        // Font character function
-        case 0x29:  // untested
-        {
-          I = FONT_START_BYTE + (5 * V[X]); // this asumes that the first 4 bits of V[X] are empty
-          break;
-        }
+static ALWAYS_INLINE void op_clear_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Clear screen (only rows with something on them change)
+  for (int y = 0; y < q->screen_height; y++) {
+    if (m->display_rows[y] != 0) {
+      m->dirty_rows |= (uint64_t)1 << y;
+    }
+  }
+  memset(m->display_rows, 0, sizeof(uint64_t) * q->screen_height);
+}
 
-        // Binary-coded decimal conversion function
-        case 0x33:
-        {
-          uint8_t D0 = V[X] / 100;
-          uint8_t D1 = (V[X] / 10) % 10;
-          uint8_t D2 = V[X] % 10;
+static inline void op_clear(Chip8Machine *m, const DecodedInstruction *d) {
+  op_clear_with(m, d, &m->profile);
+}
 
-          emu_ram[I] = D0;
-          emu_ram[I + 1] = D1;
-          emu_ram[I + 2] = D2;
+static inline void op_return(Chip8Machine *m, const DecodedInstruction *d) {
+  // Return
+  m->PC = emu_stack_pop(m);
+}
 
-          break;
-        }
+static inline void op_jump(Chip8Machine *m, const DecodedInstruction *d) {
+  // Jump
+  m->PC = d->NNN;
+}
 
-        // Store and load functions
-        case 0x55:
-        {
-          // Store function
-          // New method (temp variable)
-          uint8_t index = 0;
-          for (uint8_t i = 0; i <= X; i++) {
-            emu_ram[I + i] = V[i];
-          }
+static ALWAYS_INLINE void op_call_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Subroutine
+  emu_stack_push(m, m->PC, q->stack_size);
+  m->PC = d->NNN;
+}
 
-          // Correct for old method (doesn't actually run old method, just updates I like it did)
-          if (LOAD_STORE_MODE == 0) {
-            I = I + X + 1;
-          }
-          break;
-        }
-        case 0x65:
-        {
-          // Load function
-          // New method (temp variable)
-          uint8_t index = 0;
-          for (uint8_t i = 0; i <= X; i++) {
-            V[i] = emu_ram[I + i] ;
-          }
+static inline void op_call(Chip8Machine *m, const DecodedInstruction *d) {
+  op_call_with(m, d, &m->profile);
+}
 
-          // Correct for old method (doesn't actually run old method, just updates I like it did)
-          if (LOAD_STORE_MODE == 0) {
-            I = I + X + 1;
-          }
-          break;
-        }
-      }
-      break;
-    }
-    default:
-      //APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid opcode: %d", opcode);
-      printf("Invalid opcode: %d\n", opcode);
+static inline void op_skip_eq_nn(Chip8Machine *m, const DecodedInstruction *d) {
+  // Jump if equal
+  if (m->V[d->X] == d->NN) {
+    m->PC += 2;
   }
 }
 
-// Set a pixel in the SDL pixel array that is drawn to the screen
-void set_pixel_color(uint16_t x, uint16_t y, uint32_t color) {
-    int r = screen_pixels[y * SCREEN_WIDTH * 4 + x * 4 + 0] = (uint8_t)((color & 0xFF000000) >> 24); // r
-    int g = screen_pixels[y * SCREEN_WIDTH * 4 + x * 4 + 1] = (uint8_t)((color & 0x00FF0000) >> 16); // g
-    int b = screen_pixels[y * SCREEN_WIDTH * 4 + x * 4 + 2] = (uint8_t)((color & 0x0000FF00) >> 8); // b
-    int a = screen_pixels[y * SCREEN_WIDTH * 4 + x * 4 + 3] = (uint8_t)((color & 0x000000FF) >> 0); // a
+static inline void op_skip_ne_nn(Chip8Machine *m, const DecodedInstruction *d) {
+  // Jump if not equal
+  if (m->V[d->X] != d->NN) {
+    m->PC += 2;
+  }
 }
 
-// update the contents of the SDL pixel array using the contents of the emulated VRAM
-void update_screen_pixels() {
-    uint16_t x = 0;
-    uint16_t y = 0;
-
-    for (int vram_offset = 0; vram_offset < VRAM_SIZE; vram_offset++) {
-        // if on a new line on the screen (the second condition makes sure it's not the first line)
-        if (vram_offset * (SCREEN_WIDTH/8) % SCREEN_WIDTH == 0 && vram_offset * (SCREEN_WIDTH/8) / SCREEN_WIDTH > 0) {
-            y += 1;
-            x = 0;
-        }
+static inline void op_skip_eq_vy(Chip8Machine *m, const DecodedInstruction *d) {
+  // Jump if equal
+  if (m->V[d->X] == m->V[d->Y]) {
+    m->PC += 2;
+  }
+}
 
-        for (int bit_offset = 0; bit_offset < 8; bit_offset++) {
-            uint32_t pixel_color;
+static inline void op_set_nn(Chip8Machine *m, const DecodedInstruction *d) {
+  // Set Register
+  m->V[d->X] = d->NN;
+}
 
-            if(emu_ram[VRAM_START_BYTE + vram_offset] >> (7 - bit_offset) & 0b00000001) {
-                pixel_color = palette[1];
-            }
-            else {
-                pixel_color = palette[0];
-            }
-            set_pixel_color(x, y, pixel_color);
-            x++;
-        }
-    }
+static inline void op_add_nn(Chip8Machine *m, const DecodedInstruction *d) {
+  // Add to Register
+  m->V[d->X] += d->NN;
 }
 
-void update_screen_texture() {
-    // update texture with new data
-    int texture_pitch = 0;
-    void* texture_pixels = NULL;
-    if (SDL_LockTexture(screen_tex, NULL, &texture_pixels, &texture_pitch) != 0) {
-        SDL_Log("Unable to lock texture: %s", SDL_GetError());
-    }
-    else {
-        memcpy(texture_pixels, screen_pixels, texture_pitch * SCREEN_HEIGHT);
-    }
-    SDL_UnlockTexture(screen_tex);
+static inline void op_set_vy(Chip8Machine *m, const DecodedInstruction *d) {
+  // Set
+  m->V[d->X] = m->V[d->Y];
 }
 
-// Draws the SDL pixel array to the screen
-void draw_frame() {
-    update_screen_pixels(screen_pixels);
+static inline void op_or(Chip8Machine *m, const DecodedInstruction *d) {
+  // Binary OR
+  m->V[d->X] = m->V[d->X] | m->V[d->Y];
+}
 
-    update_screen_texture(screen_tex, screen_pixels);
+static inline void op_and(Chip8Machine *m, const DecodedInstruction *d) {
+  // Binary AND
+  m->V[d->X] = m->V[d->X] & m->V[d->Y];
+}
 
-    SDL_RenderClear(screen_ren);
-    SDL_RenderCopy(screen_ren, screen_tex, NULL, NULL);
-    SDL_RenderPresent(screen_ren);
+static inline void op_xor(Chip8Machine *m, const DecodedInstruction *d) {
+  // Logical XOR
+  m->V[d->X] = m->V[d->X] ^ m->V[d->Y];
 }
 
-int timespec_subtract (struct timespec *result, struct timespec *x, struct timespec *y)
-{
-  struct timespec x_temp;
-  x_temp.tv_sec = x->tv_sec;
-  x_temp.tv_nsec = x->tv_nsec;
-  struct timespec y_temp;
-  y_temp.tv_sec = y->tv_sec;
-  y_temp.tv_nsec = y->tv_nsec;
+// Lazy flags. Most of the time VF is overwritten or ignored after an arithmetic op sets it, so
+// 8XY4/5/6/7/E only note which flag they owe VF and the values it depends on, and it is worked out
+// by materialize_vf() when it is actually needed: before any instruction that touches VF (see
+// touches_vf), and before an engine returns, so nothing outside the engines ever sees a stale VF.
+enum {
+  FLAG_NONE = 0,  // VF holds its real value
+  FLAG_CARRY,     // a + b > 255
+  FLAG_NO_BORROW, // a >= b
+  FLAG_LOW_BIT,   // the bit shifted out of a to the right
+  FLAG_HIGH_BIT,  // the bit shifted out of a to the left
+};
 
-  struct timespec *x_temp_ptr = &x_temp;
-  struct timespec *y_temp_ptr = &y_temp;
+static inline void set_flag(Chip8Machine *m, uint8_t kind, uint8_t a, uint8_t b) {
+  m->flag_kind = kind;
+  m->flag_a = a;
+  m->flag_b = b;
+}
 
-  /* Perform the carry for the later subtraction by updating y. */
-  if (x_temp_ptr->tv_nsec < y_temp_ptr->tv_nsec) {
-    long nsec = (y_temp_ptr->tv_nsec - x_temp_ptr->tv_nsec) / 1000000000 + 1;
-    y_temp_ptr->tv_nsec -= 1000000000 * nsec;
-    y_temp_ptr->tv_sec += nsec;
+// work out the flag VF is owed. kept out of line, the engines only need the check in materialize_vf()
+static NOINLINE void write_owed_flag(Chip8Machine *m) {
+  switch (m->flag_kind) {
+    case FLAG_CARRY: m->V[0xF] = (uint16_t)m->flag_a + m->flag_b > 255; break;
+    case FLAG_NO_BORROW: m->V[0xF] = m->flag_a >= m->flag_b; break;
+    case FLAG_LOW_BIT: m->V[0xF] = m->flag_a & 0b00000001; break;
+    case FLAG_HIGH_BIT: m->V[0xF] = m->flag_a >> 7; break;
   }
-  if (x_temp_ptr->tv_nsec - y_temp_ptr->tv_nsec > 1000000000) {
-    int nsec = (x_temp_ptr->tv_nsec - y_temp_ptr->tv_nsec) / 1000000000;
-    y_temp_ptr->tv_nsec += 1000000000 * nsec;
-    y_temp_ptr->tv_sec -= nsec;
+  m->flag_kind = FLAG_NONE;
+}
+
+// write the flag VF is owed, if any
+static inline void materialize_vf(Chip8Machine *m) {
+  if (m->flag_kind != FLAG_NONE) {
+    write_owed_flag(m);
   }
+}
 
-  /* Compute the time remaining to wait.
-     tv_usec is certainly positive. */
-  result->tv_sec = x_temp_ptr->tv_sec - y_temp_ptr->tv_sec;
-  result->tv_nsec = x_temp_ptr->tv_nsec - y_temp_ptr->tv_nsec;
+static inline void op_add_vy(Chip8Machine *m, const DecodedInstruction *d) {
+  // Add (with overflow flag)
+  uint8_t a = m->V[d->X];
+  uint8_t b = m->V[d->Y];
+  m->V[d->X] = a + b;
+  set_flag(m, FLAG_CARRY, a, b);
+}
 
-  /* Return 1 if result is negative. */
-  return x_temp_ptr->tv_sec < y_temp_ptr->tv_sec;
+static inline void op_sub_vy(Chip8Machine *m, const DecodedInstruction *d) {
+  // Subtract VX - VY (with overflow flag)
+  uint8_t a = m->V[d->X];
+  uint8_t b = m->V[d->Y];
+  m->V[d->X] = a - b;
+  set_flag(m, FLAG_NO_BORROW, a, b);
 }
 
+static inline void op_sub_from_vy(Chip8Machine *m, const DecodedInstruction *d) {
+  // Subtract VY - VX (with overflow flag)
+  uint8_t a = m->V[d->Y];
+  uint8_t b = m->V[d->X];
+  m->V[d->X] = a - b;
+  set_flag(m, FLAG_NO_BORROW, a, b);
+}
 
-#ifdef _WIN32
-int get_clock_time( struct timespec *tv)
-{
-    time_t rawtime;
- 
-    time(&rawtime);
-    tv->tv_sec = (long)rawtime;
- 
-    // here starts the microsecond resolution:
- 
-    LARGE_INTEGER tickPerSecond;
-    LARGE_INTEGER tick; // a point in time
- 
-    // get the high resolution counter's accuracy
-    QueryPerformanceFrequency(&tickPerSecond);
- 
-    // what time is it ?
-    QueryPerformanceCounter(&tick);
+static ALWAYS_INLINE void op_shift_right_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Right shift
+  uint8_t a = (q->copy_shift == 1) ? m->V[d->Y] : m->V[d->X];
+  m->V[d->X] = a >> 1;
+  set_flag(m, FLAG_LOW_BIT, a, 0);
+}
 
-    //printf("Tick: %ld\n", tick);
- 
-    // and here we get the current microsecond! \o/
-    tv->tv_nsec = (tick.QuadPart % tickPerSecond.QuadPart * 100);
- 
-    return 0;
+static inline void op_shift_right(Chip8Machine *m, const DecodedInstruction *d) {
+  op_shift_right_with(m, d, &m->profile);
 }
-#else
-void get_clock_time(struct timespec *ts) {
-    clockid_t realtime_clock = CLOCK_REALTIME;
 
-    if (clock_gettime(realtime_clock, ts) == -1) {
-            printf("Time get error\n");
-            perror("clock_gettime");
-            exit(EXIT_FAILURE);
-    }
+static ALWAYS_INLINE void op_shift_left_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Left shift
+  uint8_t a = (q->copy_shift == 1) ? m->V[d->Y] : m->V[d->X];
+  m->V[d->X] = a << 1;
+  set_flag(m, FLAG_HIGH_BIT, a, 0);
 }
-#endif // _WIN32
 
-// int gettimeofday(struct timespec * tp)
-// {
-//     // Note: some broken versions only have 8 trailing zero's, the correct epoch has 9 trailing zero's
-//     // This magic number is the number of 100 nanosecond intervals since January 1, 1601 (UTC)
-//     // until 00:00:00 January 1, 1970 
-//     static const uint64_t EPOCH = ((uint64_t) 116444736000000000ULL);
+static inline void op_shift_left(Chip8Machine *m, const DecodedInstruction *d) {
+  op_shift_left_with(m, d, &m->profile);
+}
 
-//     SYSTEMTIME  system_time;
-//     FILETIME    file_time;
-//     uint64_t    time;
+static inline void op_skip_ne_vy(Chip8Machine *m, const DecodedInstruction *d) {
+  // Jump if not equal
+  if (m->V[d->X] != m->V[d->Y]) {
+    m->PC += 2;
+  }
+}
 
-//     GetSystemTime( &system_time );
-//     SystemTimeToFileTime( &system_time, &file_time );
+static inline void op_set_i(Chip8Machine *m, const DecodedInstruction *d) {
+  // Set Index
+  m->I = d->NNN;
+}
+
+static ALWAYS_INLINE void op_jump_offset_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {   // untested
+  // Jump with offset
+  if (q->jump_offset_mode == 0) {
+    // Old way
+    m->PC = d->NNN + m->V[0x0];
+  }
+  else {
+    // New way
+    m->PC = d->NNN + m->V[d->X];
+  }
+}
+
+static inline void op_jump_offset(Chip8Machine *m, const DecodedInstruction *d) {
+  op_jump_offset_with(m, d, &m->profile);
+}
+
+static inline void op_random(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  // Random
+  m->V[d->X] = next_random(m) & d->NN;
+}
+
+static ALWAYS_INLINE void op_draw_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Display
+  uint16_t coord_x = m->V[d->X] % q->screen_width;
+  uint16_t coord_y = m->V[d->Y] % q->screen_height;
+  uint64_t row_mask = ~(uint64_t)0 << (64 - q->screen_width); // the bits of a row that are on screen
+  m->V[0xF] = 0;
+  m->draw_count++;
+
+
+  for (int row = 0; row < d->N; row++) {
+    int y = coord_y + row;
+    if (y >= q->screen_height) {
+      if (q->sprite_wrap == 0) {
+        break;
+      }
+      y -= q->screen_height;
+    }
+
+    // line the sprite byte up with column 0, then shift it across to coord_x.
+    // the mask clips off anything past the right edge
+    uint64_t sprite_bits = (uint64_t)m->emu_ram[(m->I + row) & (q->ram_size - 1)] << 56;
+    uint64_t sprite_row = (sprite_bits >> coord_x) & row_mask;
+    if (q->sprite_wrap == 1 && coord_x + 8 > q->screen_width) {
+      // bring the clipped part back in on the left
+      sprite_row |= sprite_bits << (q->screen_width - coord_x);
+    }
+
+    // any pixel that is on in both gets turned off, which is a collision
+    if (m->display_rows[y] & sprite_row) {
+      m->V[0xF] = 1;
+    }
+    m->display_rows[y] ^= sprite_row;
+    if (sprite_row != 0) {
+      m->dirty_rows |= (uint64_t)1 << y;
+    }
+  }
+}
+
+static inline void op_draw(Chip8Machine *m, const DecodedInstruction *d) {
+  op_draw_with(m, d, &m->profile);
+}
+
+static inline void op_skip_key(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  // Skip if key pressed
+  if (m->V[d->X] > 0xF) {
+    printf("Warning: skip if key instuction requested invalid key number (only the low 4 bits are used)\n");
+  }
+  if (m->keypad_states[m->V[d->X] & 0xF] == 1) {
+    m->PC += 2;
+  }
+}
+
+static inline void op_skip_not_key(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  // skip if not pressed
+  if (m->V[d->X] > 0xF) {
+    printf("Warning: skip if key instuction requested invalid key number (only the low 4 bits are used)\n");
+  }
+  if (m->keypad_states[m->V[d->X] & 0xF] == 0) {
+    m->PC += 2;
+  }
+}
+
+// Timer Functions
+static inline void op_get_delay(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  m->V[d->X] = get_delay_timer(m);
+  m->timer_polls++;
+}
+
+static inline void op_set_delay(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  set_delay_timer(m, m->V[d->X]);
+}
+
+static inline void op_set_sound(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  set_sound_timer(m, m->V[d->X]);
+}
+
+// Index function
+static inline void op_add_i(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  m->I += m->V[d->X];
+  // overflow out of address space sets VF to 1 (not the case on original hardware)
+  if (m->I >= 0x1000) {
+    m->V[0xF] = 1;
+  }
+}
+
+// Get key function
+static inline void op_get_key(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  if (m->get_key_status == 2) {    // key has been pressed
+    if (m->get_key_key < 0) {
+        printf("Tried to run Get key when no key was set\n");
+    }
+    else if (m->get_key_key > 0xF) {
+        printf("Tried to run Get key with an invalid key\n");
+    }
+    else {
+        // successfully got key
+        m->V[d->X] = m->get_key_key;
+        m->get_key_status = 0;
+    }
+  }
+  else if (m->get_key_status == 0) {
+    // Start waiting for key
+    m->get_key_status = 1;
+    m->PC -= 2;
+  }
+  else {
+    // Waiting for key press
+    m->PC -= 2;
+  }
+}
+
+// Font character function
+static inline void op_font(Chip8Machine *m, const DecodedInstruction *d) {   // untested
+  m->I = FONT_START_BYTE + (5 * m->V[d->X]); // this asumes that the first 4 bits of V[X] are empty
+}
+
+// Binary-coded decimal conversion function
+static inline void op_bcd(Chip8Machine *m, const DecodedInstruction *d) {
+  uint8_t D0 = m->V[d->X] / 100;
+  uint8_t D1 = (m->V[d->X] / 10) % 10;
+  uint8_t D2 = m->V[d->X] % 10;
+
+  write_emu_ram(m, m->I, D0);
+  write_emu_ram(m, m->I + 1, D1);
+  write_emu_ram(m, m->I + 2, D2);
+}
+
+// Store and load functions
+static ALWAYS_INLINE void op_store_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Store function
+  // New method (temp variable)
+  for (uint8_t i = 0; i <= d->X; i++) {
+    write_emu_ram(m, m->I + i, m->V[i]);
+  }
+
+  // Correct for old method (doesn't actually run old method, just updates I like it did)
+  if (q->load_store_mode == 0) {
+    m->I = m->I + d->X + 1;
+  }
+}
+
+static inline void op_store(Chip8Machine *m, const DecodedInstruction *d) {
+  op_store_with(m, d, &m->profile);
+}
+
+static ALWAYS_INLINE void op_load_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // Load function
+  // New method (temp variable)
+  for (uint8_t i = 0; i <= d->X; i++) {
+    m->V[i] = m->emu_ram[(m->I + i) & (q->ram_size - 1)] ;
+  }
+
+  // Correct for old method (doesn't actually run old method, just updates I like it did)
+  if (q->load_store_mode == 0) {
+    m->I = m->I + d->X + 1;
+  }
+}
+
+static inline void op_load(Chip8Machine *m, const DecodedInstruction *d) {
+  op_load_with(m, d, &m->profile);
+}
+
+// The superinstructions. Each runs with PC pointing at its second instruction, and returns how
+// many instructions it ran.
+
+static ALWAYS_INLINE int op_set_i_draw_with(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q) {
+  // ANNN DXYN: NNN is the index, X, Y and N are the draw's
+  m->I = d->NNN;
+  m->PC += 2;
+  op_draw_with(m, d, q);
+  m->fused_instructions += 2;
+  return 2;
+}
+
+static inline int op_set_i_draw(Chip8Machine *m, const DecodedInstruction *d) {
+  return op_set_i_draw_with(m, d, &m->profile);
+}
+
+static inline int op_set_nn_pair(Chip8Machine *m, const DecodedInstruction *d) {
+  // 6XNN 6YNN: the second register is in Y and its value in NNN
+  m->V[d->X] = d->NN;
+  m->V[d->Y] = d->NNN;
+  m->PC += 2;
+  m->fused_instructions += 2;
+  return 2;
+}
+
+// the 3XNN 1NNN end of a loop: skip over the jump if VX is NN, otherwise take it
+static inline int run_loop_test(Chip8Machine *m, const DecodedInstruction *d) {
+  if (m->V[d->X] == d->NN) {
+    m->PC += 4;
+    m->fused_instructions += 2;
+    return 2;
+  }
+  m->PC = d->NNN;
+  m->fused_instructions += 3;
+  return 3;
+}
+
+static inline int op_count_loop(Chip8Machine *m, const DecodedInstruction *d) {
+  // 7XKK 3XNN 1NNN: KK is in Y, NNN is the jump's
+  m->V[d->X] += d->Y;
+  return run_loop_test(m, d);
+}
+
+// Idle loops. ROMs mostly wait by spinning, in a 1NNN that jumps to itself, an FX07 3XNN 1NNN
+// loop that polls the delay timer, or an FX0A waiting for a key (which runs itself over and over).
+// Nothing those loops look at can change partway through a run (the timers tick and the keys
+// change in between), so once one has gone round it would go round for the rest of the budget.
+// The engines spot them and take all of those passes in one go, which gets to the end of the
+// frame straight away: a live run sleeps there and a headless one moves on. Every pass that
+// goes round counts in idle_instructions, the first one too, so each engine comes to the same count.
+
+// FX07 3XNN 1NNN that jumps back to its own FX07. budget includes the pass it is starting
+static inline uint64_t op_delay_wait(Chip8Machine *m, const DecodedInstruction *d, uint64_t budget) {
+  // FX07 3XNN 1NNN: NNN is the jump's
+  uint16_t address = m->PC - 2;
+  m->V[d->X] = get_delay_timer(m);
+  m->timer_polls++;
+  int ran = run_loop_test(m, d);
+  if (ran == 3 && d->NNN == address) {
+    // back where it started and still waiting, which it will keep doing until the timers tick.
+    // the pass that found that out is idle too, as skip_idle_loop() counts it
+    uint64_t passes = (budget - 3) / 3 * 3;
+    m->idle_instructions += 3 + passes;
+    m->timer_polls += passes / 3;
+    return 3 + passes;
+  }
+  return ran;
+}
+
+// 1NNN to itself: everything left in the budget would be this jump again
+static inline uint64_t op_idle_jump(Chip8Machine *m, const DecodedInstruction *d, uint64_t budget) {
+  m->PC = d->NNN;
+  m->idle_instructions += budget;
+  return budget;
+}
+
+// FX0A: once it is waiting it would only run itself again for the rest of the budget
+static inline uint64_t op_get_key_idle(Chip8Machine *m, const DecodedInstruction *d, uint64_t budget) {
+  op_get_key(m, d);
+  if (m->get_key_status != 1) {
+    return 1;
+  }
+  m->idle_instructions += budget;
+  return budget;
+}
+
+// FX0A for the engines that compile it, which go back to skip_idle_loop() afterwards. counts the
+// run that leaves it waiting, as op_get_key_idle() does
+static inline void op_get_key_counted(Chip8Machine *m, const DecodedInstruction *d) {
+  op_get_key(m, d);
+  if (m->get_key_status == 1) {
+    m->idle_instructions++;
+  }
+}
+
+// whether a 1NNN at jump_address to target closes one of the idle loops, going by the code alone.
+// for the engines that compile their jumps, which then check skip_idle_loop() when they get there
+static bool is_idle_loop_jump(Chip8Machine *m, uint16_t jump_address, uint16_t target) {
+  if (target == jump_address) {
+    return true;
+  }
+  if (target + 4 != jump_address) {
+    return false;
+  }
+  uint16_t get_delay = fetch_instruction(m, target);
+  uint16_t skip = fetch_instruction(m, target + 2);
+  return (get_delay & 0xF0FF) == 0xF007 && (skip & 0xFF00) == (0x3000 | (get_delay & 0x0F00));
+}
+
+// if PC is at an idle loop that will keep going round for the rest of this run, take as many
+// whole passes of it as fit in budget at once. returns how many instructions that came to, 0 if
+// there is no such loop at PC
+static uint64_t skip_idle_loop(Chip8Machine *m, uint64_t budget) {
+  uint16_t address = m->PC;
+  if (address + 6 > RAM_SIZE) {
+    return 0;
+  }
+  uint16_t first = fetch_instruction(m, address);
+  if (first == (0x1000 | address) || ((first & 0xF0FF) == 0xF00A && m->get_key_status == 1)) {
+    m->idle_instructions += budget;
+    return budget;
+  }
+  if ((first & 0xF0FF) == 0xF007 && budget >= 3) {
+    uint8_t x = (first >> 8) & 0xF;
+    uint16_t skip = fetch_instruction(m, address + 2);
+    if ((skip & 0xFF00) == (0x3000 | (x << 8)) && fetch_instruction(m, address + 4) == (0x1000 | address) &&
+        get_delay_timer(m) != (skip & 0xFF)) {
+      materialize_vf(m); // in case X is F
+      m->V[x] = get_delay_timer(m);
+      uint64_t passes = budget / 3 * 3;
+      m->idle_instructions += passes;
+      m->timer_polls += passes / 3;
+      return passes;
+    }
+  }
+  return 0;
+}
+
+// runs the decoded op d, which is the one at the current PC. quirks and sizes come from q, and budget
+// is how many instructions it may run (only idle loops take more than their own). returns how many ran
+static ALWAYS_INLINE uint64_t run_op(Chip8Machine *m, const DecodedInstruction *d, const Chip8Profile *q, uint64_t budget) {
+  if (d->touches_vf) {
+    materialize_vf(m);
+  }
+  m->PC += 2;
+
+  switch(d->op) {
+    case OP_INVALID: op_invalid(m, d); break;
+    case OP_NOP: break;
+    case OP_CLEAR: op_clear_with(m, d, q); break;
+    case OP_RETURN: op_return(m, d); break;
+    case OP_JUMP: op_jump(m, d); break;
+    case OP_CALL: op_call_with(m, d, q); break;
+    case OP_SKIP_EQ_NN: op_skip_eq_nn(m, d); break;
+    case OP_SKIP_NE_NN: op_skip_ne_nn(m, d); break;
+    case OP_SKIP_EQ_VY: op_skip_eq_vy(m, d); break;
+    case OP_SET_NN: op_set_nn(m, d); break;
+    case OP_ADD_NN: op_add_nn(m, d); break;
+    case OP_SET_VY: op_set_vy(m, d); break;
+    case OP_OR: op_or(m, d); break;
+    case OP_AND: op_and(m, d); break;
+    case OP_XOR: op_xor(m, d); break;
+    case OP_ADD_VY: op_add_vy(m, d); break;
+    case OP_SUB_VY: op_sub_vy(m, d); break;
+    case OP_SHIFT_RIGHT: op_shift_right_with(m, d, q); break;
+    case OP_SUB_FROM_VY: op_sub_from_vy(m, d); break;
+    case OP_SHIFT_LEFT: op_shift_left_with(m, d, q); break;
+    case OP_SKIP_NE_VY: op_skip_ne_vy(m, d); break;
+    case OP_SET_I: op_set_i(m, d); break;
+    case OP_JUMP_OFFSET: op_jump_offset_with(m, d, q); break;
+    case OP_RANDOM: op_random(m, d); break;
+    case OP_DRAW: op_draw_with(m, d, q); break;
+    case OP_SKIP_KEY: op_skip_key(m, d); break;
+    case OP_SKIP_NOT_KEY: op_skip_not_key(m, d); break;
+    case OP_GET_DELAY: op_get_delay(m, d); break;
+    case OP_GET_KEY: return op_get_key_idle(m, d, budget);
+    case OP_SET_DELAY: op_set_delay(m, d); break;
+    case OP_SET_SOUND: op_set_sound(m, d); break;
+    case OP_ADD_I: op_add_i(m, d); break;
+    case OP_FONT: op_font(m, d); break;
+    case OP_BCD: op_bcd(m, d); break;
+    case OP_STORE: op_store_with(m, d, q); break;
+    case OP_LOAD: op_load_with(m, d, q); break;
+    case OP_SET_I_DRAW: return op_set_i_draw_with(m, d, q);
+    case OP_SET_NN_PAIR: return op_set_nn_pair(m, d);
+    case OP_COUNT_LOOP: return op_count_loop(m, d);
+    case OP_DELAY_WAIT: return op_delay_wait(m, d, budget);
+    case OP_IDLE_JUMP: return op_idle_jump(m, d, budget);
+  }
+  return 1;
+}
+
+// runs the op at the current PC: the superinstruction starting there if budget has room for it,
+// otherwise just the one instruction. quirks and sizes come from q. returns how many instructions ran
+static ALWAYS_INLINE uint64_t run_next_op(Chip8Machine *m, uint64_t budget, const Chip8Profile *q) {
+  uint16_t address = m->PC & (q->ram_size - 1);
+  if (m->decoded[address].op == OP_UNDECODED) {
+    decode_address(m, address);
+  }
+  const DecodedInstruction *d = &m->decoded[address];
+  DecodedInstruction single;
+  if (d->op >= OP_FIRST_FUSED && budget < MAX_FUSED_LENGTH) {
+    single = decode_instruction(d->instruction);
+    d = &single;
+  }
+  return run_op(m, d, q, budget);
+}
+
+// runs one Chip8 instruction at the current PC
+void run_next_instruction(Chip8Machine *m) {
+  run_next_op(m, 1, &m->profile);
+  materialize_vf(m);
+}
+
+// Engines. Each runs count instructions on the machine and returns how many it ran.
+
+// runs the instructions through run_next_op()'s switch with the quirks and sizes from q. it is
+// always inlined, so each build of it below with a constant profile gets its own copy with the
+// quirk checks folded away
+static ALWAYS_INLINE uint64_t run_instructions_switch_with(Chip8Machine *m, uint64_t count, const Chip8Profile *q) {
+  uint64_t ran = 0;
+  while (ran < count) {
+    ran += run_next_op(m, count - ran, q);
+  }
+  materialize_vf(m);
+  return count;
+}
+
+// the usual quirk profiles, with the sizes initialize_settings() sets up. the default is what
+// initialize_settings() itself picks, so runs without --profile get a build of their own as well
+static const Chip8Profile PROFILE_DEFAULT = { 0, 0, 1, 0, 64, 32, 4096, 16 }; // this emulator's own defaults
+static const Chip8Profile PROFILE_VIP = { 1, 0, 0, 0, 64, 32, 4096, 16 }; // the original COSMAC VIP interpreter
+static const Chip8Profile PROFILE_CHIP48 = { 0, 1, 1, 0, 64, 32, 4096, 16 }; // HP48 CHIP-48 (its FX55/FX65 leave I at I + X, which isn't modelled, so this is the same as SCHIP)
+static const Chip8Profile PROFILE_SCHIP = { 0, 1, 1, 0, 64, 32, 4096, 16 }; // SUPER-CHIP 1.1, low resolution
+static const Chip8Profile PROFILE_XOCHIP = { 1, 0, 0, 1, 64, 32, 4096, 16 }; // XO-CHIP, within 4KB and 64x32
+
+static uint64_t run_instructions_switch_generic(Chip8Machine *m, uint64_t count) {
+  return run_instructions_switch_with(m, count, &m->profile);
+}
+static uint64_t run_instructions_switch_default(Chip8Machine *m, uint64_t count) {
+  return run_instructions_switch_with(m, count, &PROFILE_DEFAULT);
+}
+static uint64_t run_instructions_switch_vip(Chip8Machine *m, uint64_t count) {
+  return run_instructions_switch_with(m, count, &PROFILE_VIP);
+}
+static uint64_t run_instructions_switch_schip(Chip8Machine *m, uint64_t count) {
+  return run_instructions_switch_with(m, count, &PROFILE_SCHIP);
+}
+static uint64_t run_instructions_switch_xochip(Chip8Machine *m, uint64_t count) {
+  return run_instructions_switch_with(m, count, &PROFILE_XOCHIP);
+}
+
+typedef struct NamedProfile {
+    const char *name; // for --profile
+    const Chip8Profile *profile;
+    uint64_t (*switch_engine)(Chip8Machine *m, uint64_t count);
+} NamedProfile;
+
+static const NamedProfile named_profiles[] = {
+  { "default", &PROFILE_DEFAULT, run_instructions_switch_default },
+  { "vip", &PROFILE_VIP, run_instructions_switch_vip },
+  { "chip48", &PROFILE_CHIP48, run_instructions_switch_schip },
+  { "schip", &PROFILE_SCHIP, run_instructions_switch_schip },
+  { "xochip", &PROFILE_XOCHIP, run_instructions_switch_xochip },
+};
+#define NAMED_PROFILE_COUNT (int)(sizeof(named_profiles) / sizeof(named_profiles[0]))
+
+static bool same_profile(const Chip8Profile *a, const Chip8Profile *b) {
+  return a->copy_shift == b->copy_shift && a->jump_offset_mode == b->jump_offset_mode &&
+         a->load_store_mode == b->load_store_mode && a->sprite_wrap == b->sprite_wrap &&
+         a->screen_width == b->screen_width && a->screen_height == b->screen_height &&
+         a->ram_size == b->ram_size && a->stack_size == b->stack_size;
+}
+
+// runs the instructions on the build of the switch engine made for the machine's profile, or the
+// generic one that reads the machine's quirks as it goes if none matches
+uint64_t run_instructions_switch(Chip8Machine *m, uint64_t count) {
+  if (m->switch_engine == NULL) {
+    m->switch_engine = run_instructions_switch_generic;
+    for (int i = 0; i < NAMED_PROFILE_COUNT; i++) {
+      if (same_profile(&m->profile, named_profiles[i].profile)) {
+        m->switch_engine = named_profiles[i].switch_engine;
+        break;
+      }
+    }
+  }
+  return m->switch_engine(m, count);
+}
+
+#ifdef __GNUC__
+// threaded code: every operation has its own label, and each one ends by fetching the next
+// instruction and jumping straight to that instruction's label (GCC's labels as values).
+// there is no central switch, so each jump gets its own slot in the branch predictor
+uint64_t run_instructions_threaded(Chip8Machine *m, uint64_t count) {
+  static void *handlers[OP_COUNT] = {
+    [OP_UNDECODED] = &&handle_undecoded,
+    [OP_INVALID] = &&handle_invalid,
+    [OP_NOP] = &&handle_nop,
+    [OP_CLEAR] = &&handle_clear,
+    [OP_RETURN] = &&handle_return,
+    [OP_JUMP] = &&handle_jump,
+    [OP_CALL] = &&handle_call,
+    [OP_SKIP_EQ_NN] = &&handle_skip_eq_nn,
+    [OP_SKIP_NE_NN] = &&handle_skip_ne_nn,
+    [OP_SKIP_EQ_VY] = &&handle_skip_eq_vy,
+    [OP_SET_NN] = &&handle_set_nn,
+    [OP_ADD_NN] = &&handle_add_nn,
+    [OP_SET_VY] = &&handle_set_vy,
+    [OP_OR] = &&handle_or,
+    [OP_AND] = &&handle_and,
+    [OP_XOR] = &&handle_xor,
+    [OP_ADD_VY] = &&handle_add_vy,
+    [OP_SUB_VY] = &&handle_sub_vy,
+    [OP_SHIFT_RIGHT] = &&handle_shift_right,
+    [OP_SUB_FROM_VY] = &&handle_sub_from_vy,
+    [OP_SHIFT_LEFT] = &&handle_shift_left,
+    [OP_SKIP_NE_VY] = &&handle_skip_ne_vy,
+    [OP_SET_I] = &&handle_set_i,
+    [OP_JUMP_OFFSET] = &&handle_jump_offset,
+    [OP_RANDOM] = &&handle_random,
+    [OP_DRAW] = &&handle_draw,
+    [OP_SKIP_KEY] = &&handle_skip_key,
+    [OP_SKIP_NOT_KEY] = &&handle_skip_not_key,
+    [OP_GET_DELAY] = &&handle_get_delay,
+    [OP_GET_KEY] = &&handle_get_key,
+    [OP_SET_DELAY] = &&handle_set_delay,
+    [OP_SET_SOUND] = &&handle_set_sound,
+    [OP_ADD_I] = &&handle_add_i,
+    [OP_FONT] = &&handle_font,
+    [OP_BCD] = &&handle_bcd,
+    [OP_STORE] = &&handle_store,
+    [OP_LOAD] = &&handle_load,
+    [OP_SET_I_DRAW] = &&handle_set_i_draw,
+    [OP_SET_NN_PAIR] = &&handle_set_nn_pair,
+    [OP_COUNT_LOOP] = &&handle_count_loop,
+    [OP_DELAY_WAIT] = &&handle_delay_wait,
+    [OP_IDLE_JUMP] = &&handle_idle_jump,
+  };
+  const DecodedInstruction *d;
+  DecodedInstruction single;
+  uint64_t remaining = count;
+
+#define DISPATCH() \
+  do { \
+    if (remaining == 0) { \
+      goto done; \
+    } \
+    remaining--; \
+    d = &m->decoded[m->PC & RAM_ADDRESS_MASK]; \
+    if (d->touches_vf) { \
+      materialize_vf(m); \
+    } \
+    m->PC += 2; \
+    goto *handlers[d->op]; \
+  } while (0)
+
+// a superinstruction (run, a call to its op) runs if what is left of the budget has room for it
+// (DISPATCH already took one off), otherwise only its first instruction runs
+#define RUN_FUSED(run) \
+  do { \
+    if (remaining < MAX_FUSED_LENGTH - 1) { \
+      single = decode_instruction(d->instruction); \
+      d = &single; \
+      goto *handlers[d->op]; \
+    } \
+    remaining -= (run) - 1; \
+  } while (0)
+
+  DISPATCH();
+
+handle_undecoded:
+  // decode it in place, then carry on as if it had been decoded all along
+  decode_address(m, (m->PC - 2) & RAM_ADDRESS_MASK);
+  if (d->touches_vf) {
+    materialize_vf(m);
+  }
+  goto *handlers[d->op];
+handle_invalid:
+  op_invalid(m, d);
+  DISPATCH();
+handle_nop:
+  DISPATCH();
+handle_clear:
+  op_clear(m, d);
+  DISPATCH();
+handle_return:
+  op_return(m, d);
+  DISPATCH();
+handle_jump:
+  op_jump(m, d);
+  DISPATCH();
+handle_call:
+  op_call(m, d);
+  DISPATCH();
+handle_skip_eq_nn:
+  op_skip_eq_nn(m, d);
+  DISPATCH();
+handle_skip_ne_nn:
+  op_skip_ne_nn(m, d);
+  DISPATCH();
+handle_skip_eq_vy:
+  op_skip_eq_vy(m, d);
+  DISPATCH();
+handle_set_nn:
+  op_set_nn(m, d);
+  DISPATCH();
+handle_add_nn:
+  op_add_nn(m, d);
+  DISPATCH();
+handle_set_vy:
+  op_set_vy(m, d);
+  DISPATCH();
+handle_or:
+  op_or(m, d);
+  DISPATCH();
+handle_and:
+  op_and(m, d);
+  DISPATCH();
+handle_xor:
+  op_xor(m, d);
+  DISPATCH();
+handle_add_vy:
+  op_add_vy(m, d);
+  DISPATCH();
+handle_sub_vy:
+  op_sub_vy(m, d);
+  DISPATCH();
+handle_shift_right:
+  op_shift_right(m, d);
+  DISPATCH();
+handle_sub_from_vy:
+  op_sub_from_vy(m, d);
+  DISPATCH();
+handle_shift_left:
+  op_shift_left(m, d);
+  DISPATCH();
+handle_skip_ne_vy:
+  op_skip_ne_vy(m, d);
+  DISPATCH();
+handle_set_i:
+  op_set_i(m, d);
+  DISPATCH();
+handle_jump_offset:
+  op_jump_offset(m, d);
+  DISPATCH();
+handle_random:
+  op_random(m, d);
+  DISPATCH();
+handle_draw:
+  op_draw(m, d);
+  DISPATCH();
+handle_skip_key:
+  op_skip_key(m, d);
+  DISPATCH();
+handle_skip_not_key:
+  op_skip_not_key(m, d);
+  DISPATCH();
+handle_get_delay:
+  op_get_delay(m, d);
+  DISPATCH();
+handle_get_key:
+  remaining -= op_get_key_idle(m, d, remaining + 1) - 1;
+  DISPATCH();
+handle_set_delay:
+  op_set_delay(m, d);
+  DISPATCH();
+handle_set_sound:
+  op_set_sound(m, d);
+  DISPATCH();
+handle_add_i:
+  op_add_i(m, d);
+  DISPATCH();
+handle_font:
+  op_font(m, d);
+  DISPATCH();
+handle_bcd:
+  op_bcd(m, d);
+  DISPATCH();
+handle_store:
+  op_store(m, d);
+  DISPATCH();
+handle_load:
+  op_load(m, d);
+  DISPATCH();
+handle_set_i_draw:
+  RUN_FUSED(op_set_i_draw(m, d));
+  DISPATCH();
+handle_set_nn_pair:
+  RUN_FUSED(op_set_nn_pair(m, d));
+  DISPATCH();
+handle_count_loop:
+  RUN_FUSED(op_count_loop(m, d));
+  DISPATCH();
+handle_delay_wait:
+  RUN_FUSED(op_delay_wait(m, d, remaining + 1));
+  DISPATCH();
+handle_idle_jump:
+  remaining -= op_idle_jump(m, d, remaining + 1) - 1;
+  DISPATCH();
+
+done:
+  materialize_vf(m);
+  return count;
+#undef DISPATCH
+#undef RUN_FUSED
+}
+#endif // __GNUC__
+
+#ifdef HAVE_DYNAREC
+// Dynamic recompiler. The first time a run of instructions is reached it is translated into x86-64
+// machine code, which is kept in a code cache under the address the run starts at.
+//
+// Translated code keeps the machine in rbx, the table of block entry points in r12 and how many
+// instructions it may still run in r13 (all callee saved, so op_ calls leave them alone). A block
+// first checks there is budget for all of its instructions and takes them off r13, then runs them
+// and stores the next PC. Register operations are done inline; everything else calls the same op_
+// function the interpreters use. Blocks end at anything that can change PC, at DXYN, and at
+// FX33/FX55, which may have just overwritten translated code. A block whose next PC is known
+// jumps straight to the next block if that was already translated, otherwise it looks the next
+// block up itself. When PC has no block yet, or there isn't enough budget left for the next one,
+// control goes back to C.
+
+#define DYNAREC_CODE_SIZE (4 * 1024 * 1024) // bytes of code cache, it is emptied and refilled when full
+#define DYNAREC_MAX_BLOCK 64 // most instructions in one block
+#define DYNAREC_MAX_INSTRUCTION_BYTES 64 // most machine code bytes one instruction translates to
+
+typedef uint64_t (*DynarecEntry)(Chip8Machine *m, uint8_t **blocks, uint64_t budget);
+
+typedef struct Chip8Dynarec {
+    uint8_t *code; // the code cache (readable, writable and executable)
+    size_t code_used;
+    size_t code_start; // where the blocks start, the entry and exit code sit in front of them
+    DynarecEntry enter; // enter(m, blocks, budget) runs blocks until it returns the unused budget
+    uint8_t *exit;
+    uint8_t **blocks; // the block starting at each emu_ram address, NULL if there isn't one yet
+    uint16_t *block_length; // the number of instructions in each of those blocks
+    uint8_t *translated; // nonzero for each emu_ram byte some block was translated from
+    DecodedInstruction *operands; // the instructions op_ calls in the blocks are handed, by address
+    uint64_t run_count; // the count of the run going on, so a block can tell how much of it has gone
+} Chip8Dynarec;
+
+// offsets into the machine, small enough to use one byte displacements from rbx
+#define DYNAREC_OFFSET(field) ((uint8_t)offsetof(Chip8Machine, field))
+_Static_assert(offsetof(Chip8Machine, I) + 2 <= 127, "registers must be within 127 bytes of the start of Chip8Machine");
+
+// append machine code at p
+#define EMIT(...) \
+  do { \
+    const uint8_t bytes_[] = { __VA_ARGS__ }; \
+    memcpy(p, bytes_, sizeof(bytes_)); \
+    p += sizeof(bytes_); \
+  } while (0)
+#define EMIT_VALUE(type, value) \
+  do { \
+    type value_ = (type)(value); \
+    memcpy(p, &value_, sizeof(value_)); \
+    p += sizeof(value_); \
+  } while (0)
+#define EMIT16(value) EMIT_VALUE(uint16_t, value)
+#define EMIT32(value) EMIT_VALUE(uint32_t, value)
+#define EMIT64(value) EMIT_VALUE(uint64_t, value)
+#define EMIT_REL32(target) EMIT_VALUE(int32_t, (target) - (p + 4))
+
+// mov word [rbx+PC], pc
+static uint8_t *emit_set_pc(uint8_t *p, uint16_t pc) {
+  EMIT(0x66, 0xC7, 0x43, DYNAREC_OFFSET(PC));
+  EMIT16(pc);
+  return p;
+}
+
+// op(m, d) with the machine from rbx
+static uint8_t *emit_call_op(uint8_t *p, void (*op)(Chip8Machine *, const DecodedInstruction *), const DecodedInstruction *d) {
+#ifdef _WIN32
+  EMIT(0x48, 0x89, 0xD9); // mov rcx, rbx
+  EMIT(0x48, 0xBA); // mov rdx, d
+#else
+  EMIT(0x48, 0x89, 0xDF); // mov rdi, rbx
+  EMIT(0x48, 0xBE); // mov rsi, d
+#endif // _WIN32
+  EMIT64((uintptr_t)d);
+  EMIT(0x48, 0xB8); // mov rax, op
+  EMIT64((uintptr_t)op);
+  EMIT(0xFF, 0xD0); // call rax
+  return p;
+}
+
+// go on to the block for whatever PC is now
+static uint8_t *emit_dispatch(uint8_t *p, Chip8Dynarec *dyn) {
+  EMIT(0x0F, 0xB7, 0x43, DYNAREC_OFFSET(PC)); // movzx eax, word [rbx+PC]
+  EMIT(0x3D); // cmp eax, RAM_ADDRESS_MASK
+  EMIT32(RAM_ADDRESS_MASK);
+  EMIT(0x0F, 0x87); // ja exit (PC ran off the end of emu_ram)
+  EMIT_REL32(dyn->exit);
+  EMIT(0x49, 0x8B, 0x14, 0xC4); // mov rdx, [r12+rax*8]
+  EMIT(0x48, 0x85, 0xD2); // test rdx, rdx
+  EMIT(0x0F, 0x84); // jz exit
+  EMIT_REL32(dyn->exit);
+  EMIT(0xFF, 0xE2); // jmp rdx
+  return p;
+}
+
+// set PC to target and go on to its block
+static uint8_t *emit_link(uint8_t *p, Chip8Dynarec *dyn, uint16_t target) {
+  p = emit_set_pc(p, target);
+  if (target > RAM_ADDRESS_MASK) {
+    EMIT(0xE9); // jmp exit
+    EMIT_REL32(dyn->exit);
+  }
+  else if (dyn->blocks[target] != NULL) {
+    // blocks are only ever thrown away all together, so this can't go stale
+    EMIT(0xE9); // jmp block
+    EMIT_REL32(dyn->blocks[target]);
+  }
+  else {
+    EMIT(0x49, 0x8B, 0x94, 0x24); // mov rdx, [r12+target*8]
+    EMIT32(target * sizeof(uint8_t *));
+    EMIT(0x48, 0x85, 0xD2); // test rdx, rdx
+    EMIT(0x0F, 0x84); // jz exit
+    EMIT_REL32(dyn->exit);
+    EMIT(0xFF, 0xE2); // jmp rdx
+  }
+  return p;
+}
+
+// go to next + 2 if the last compare matched, otherwise to next. jcc is 0x84 to skip when
+// equal, 0x85 when not equal
+static uint8_t *emit_skip(uint8_t *p, Chip8Dynarec *dyn, uint8_t jcc, uint16_t next) {
+  EMIT(0x0F, jcc); // jcc skip
+  uint8_t *skip_jump = p;
+  p += 4;
+  p = emit_link(p, dyn, next);
+  int32_t skip_distance = p - (skip_jump + 4);
+  memcpy(skip_jump, &skip_distance, 4);
+  return emit_link(p, dyn, next + 2);
+}
+
+// forget every block
+static void dynarec_flush(Chip8Dynarec *dyn) {
+  memset(dyn->blocks, 0, sizeof(uint8_t *) * RAM_SIZE);
+  memset(dyn->translated, 0, RAM_SIZE);
+  dyn->code_used = dyn->code_start;
+}
+
+// set up a code cache for the machine. returns NULL if no executable memory could be had
+static Chip8Dynarec *create_dynarec(Chip8Machine *m) {
+#ifdef _WIN32
+  uint8_t *code = VirtualAlloc(NULL, DYNAREC_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+  if (code == NULL) {
+    return NULL;
+  }
+#else
+  uint8_t *code = mmap(NULL, DYNAREC_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return NULL;
+  }
+#endif // _WIN32
+
+  Chip8Dynarec *dyn = malloc(sizeof(Chip8Dynarec));
+  dyn->code = code;
+  dyn->blocks = malloc(sizeof(uint8_t *) * RAM_SIZE);
+  dyn->block_length = malloc(sizeof(uint16_t) * RAM_SIZE);
+  dyn->translated = malloc(RAM_SIZE);
+  dyn->operands = malloc(sizeof(DecodedInstruction) * RAM_SIZE);
+  uint8_t *p = code;
+
+  // exit: hand back what is left of the budget and restore the caller's registers
+  dyn->exit = p;
+  EMIT(0x4C, 0x89, 0xE8); // mov rax, r13
+  EMIT(0x48, 0x83, 0xC4, 0x28); // add rsp, 40
+  EMIT(0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B); // pop r14, r13, r12, rbx
+  EMIT(0xC3); // ret
+
+  // enter(m, blocks, budget)
+  dyn->enter = (DynarecEntry)p;
+  EMIT(0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56); // push rbx, r12, r13, r14 (r14 only keeps the stack 16 byte aligned)
+  EMIT(0x48, 0x83, 0xEC, 0x28); // sub rsp, 40 (the 32 bytes of shadow space Win64 calls need, and alignment)
+#ifdef _WIN32
+  EMIT(0x48, 0x89, 0xCB); // mov rbx, rcx
+  EMIT(0x49, 0x89, 0xD4); // mov r12, rdx
+  EMIT(0x4D, 0x89, 0xC5); // mov r13, r8
+#else
+  EMIT(0x48, 0x89, 0xFB); // mov rbx, rdi
+  EMIT(0x49, 0x89, 0xF4); // mov r12, rsi
+  EMIT(0x49, 0x89, 0xD5); // mov r13, rdx
+#endif // _WIN32
+  p = emit_dispatch(p, dyn);
+
+  dyn->code_start = p - code;
+  dynarec_flush(dyn);
+  m->translated = dyn->translated;
+  return dyn;
+}
+
+void destroy_dynarec(Chip8Dynarec *dyn) {
+#ifdef _WIN32
+  VirtualFree(dyn->code, 0, MEM_RELEASE);
+#else
+  munmap(dyn->code, DYNAREC_CODE_SIZE);
+#endif // _WIN32
+  free(dyn->blocks);
+  free(dyn->block_length);
+  free(dyn->translated);
+  free(dyn->operands);
+  free(dyn);
+}
+
+// translate the block starting at address. returns false if the code cache is too full to hold it
+static bool dynarec_translate(Chip8Machine *m, Chip8Dynarec *dyn, uint16_t address) {
+  if (dyn->code_used + 64 + DYNAREC_MAX_BLOCK * DYNAREC_MAX_INSTRUCTION_BYTES > DYNAREC_CODE_SIZE) {
+    return false;
+  }
+  uint8_t *block = dyn->code + dyn->code_used;
+  uint8_t *p = block;
+
+  EMIT(0x49, 0x83, 0xFD, 0); // cmp r13, length (filled in at the end)
+  uint8_t *length_check = p - 1;
+  EMIT(0x0F, 0x82); // jb exit
+  EMIT_REL32(dyn->exit);
+  EMIT(0x49, 0x83, 0xED, 0); // sub r13, length
+  uint8_t *length_take = p - 1;
+  dyn->blocks[address] = block; // so a loop back to the start can jump straight here
+
+  uint16_t pc = address;
+  int length = 0;
+  bool block_done = false;
+  while (!block_done) {
+    DecodedInstruction *d = &dyn->operands[pc];
+    *d = decode_instruction((m->emu_ram[pc] << 8) | m->emu_ram[(pc + 1) & RAM_ADDRESS_MASK]);
+    dyn->translated[pc] = 1;
+    dyn->translated[(pc + 1) & RAM_ADDRESS_MASK] = 1;
+    length++;
+
+    uint16_t next = pc + 2;
+    uint8_t vx = DYNAREC_OFFSET(V) + d->X;
+    uint8_t vy = DYNAREC_OFFSET(V) + d->Y;
+    uint8_t vf = DYNAREC_OFFSET(V) + 0xF;
+    switch (d->op) {
+      case OP_NOP:
+        break;
+      case OP_SET_NN:
+        EMIT(0xC6, 0x43, vx, d->NN); // mov byte [VX], NN
+        break;
+      case OP_ADD_NN:
+        EMIT(0x80, 0x43, vx, d->NN); // add byte [VX], NN
+        break;
+      case OP_SET_VY:
+        EMIT(0x8A, 0x43, vy); // mov al, [VY]
+        EMIT(0x88, 0x43, vx); // mov [VX], al
+        break;
+      case OP_OR:
+        EMIT(0x8A, 0x43, vy); // mov al, [VY]
+        EMIT(0x08, 0x43, vx); // or [VX], al
+        break;
+      case OP_AND:
+        EMIT(0x8A, 0x43, vy); // mov al, [VY]
+        EMIT(0x20, 0x43, vx); // and [VX], al
+        break;
+      case OP_XOR:
+        EMIT(0x8A, 0x43, vy); // mov al, [VY]
+        EMIT(0x30, 0x43, vx); // xor [VX], al
+        break;
+      case OP_SUB_VY:
+      case OP_SUB_FROM_VY:
+        // the flag is worked out from the old values, then VX is written before VF like the interpreters do
+        EMIT(0x8A, 0x43, (d->op == OP_SUB_VY) ? vx : vy); // mov al, [VX] / [VY]
+        EMIT(0x2A, 0x43, (d->op == OP_SUB_VY) ? vy : vx); // sub al, [VY] / [VX]
+        EMIT(0x0F, 0x93, 0xC1); // setnc cl (1 when nothing was borrowed)
+        EMIT(0x88, 0x43, vx); // mov [VX], al
+        EMIT(0x88, 0x4B, vf); // mov [VF], cl
+        break;
+      case OP_ADD_VY:
+        EMIT(0x8A, 0x43, vx); // mov al, [VX]
+        EMIT(0x02, 0x43, vy); // add al, [VY]
+        EMIT(0x0F, 0x92, 0xC1); // setc cl
+        EMIT(0x88, 0x43, vx); // mov [VX], al
+        EMIT(0x88, 0x4B, vf); // mov [VF], cl
+        break;
+      case OP_SHIFT_RIGHT:
+      case OP_SHIFT_LEFT:
+        EMIT(0x8A, 0x43, (m->profile.copy_shift == 1) ? vy : vx); // mov al, [VY] / [VX]
+        EMIT(0xD0, (d->op == OP_SHIFT_RIGHT) ? 0xE8 : 0xE0); // shr / shl al, 1
+        EMIT(0x0F, 0x92, 0xC1); // setc cl (the bit shifted out)
+        EMIT(0x88, 0x43, vx); // mov [VX], al
+        EMIT(0x88, 0x4B, vf); // mov [VF], cl
+        break;
+      case OP_SET_I:
+        EMIT(0x66, 0xC7, 0x43, DYNAREC_OFFSET(I)); // mov word [I], NNN
+        EMIT16(d->NNN);
+        break;
+      case OP_JUMP:
+        if (is_idle_loop_jump(m, pc, d->NNN)) {
+          // that pass went round, so it was idle. a delay loop's pass only counts if all of it
+          // was in this run (at least 3 instructions have gone), as the interpreter only counts
+          // the whole passes its fused op runs
+          if (d->NNN != pc) {
+            EMIT(0x48, 0xB8); // mov rax, &dyn->run_count
+            EMIT64((uintptr_t)&dyn->run_count);
+            EMIT(0x48, 0x8B, 0x00); // mov rax, [rax]
+            EMIT(0x4C, 0x29, 0xE8); // sub rax, r13
+            EMIT(0x48, 0x83, 0xF8, 0x03); // cmp rax, 3
+            EMIT(0x72, 0x08); // jb past the add
+          }
+          EMIT(0x48, 0x83, 0x83); // add qword [rbx+idle_instructions], 1 or 3
+          EMIT32(offsetof(Chip8Machine, idle_instructions));
+          EMIT((d->NNN == pc) ? 1 : 3);
+          // back to C, which checks whether the loop is waiting and skips the rest of its passes
+          p = emit_set_pc(p, d->NNN);
+          EMIT(0xE9); // jmp exit
+          EMIT_REL32(dyn->exit);
+        }
+        else {
+          p = emit_link(p, dyn, d->NNN);
+        }
+        block_done = true;
+        break;
+      case OP_SKIP_EQ_NN:
+      case OP_SKIP_NE_NN:
+        EMIT(0x80, 0x7B, vx, d->NN); // cmp byte [VX], NN
+        p = emit_skip(p, dyn, (d->op == OP_SKIP_EQ_NN) ? 0x84 : 0x85, next);
+        block_done = true;
+        break;
+      case OP_SKIP_EQ_VY:
+      case OP_SKIP_NE_VY:
+        EMIT(0x8A, 0x43, vy); // mov al, [VY]
+        EMIT(0x38, 0x43, vx); // cmp [VX], al
+        p = emit_skip(p, dyn, (d->op == OP_SKIP_EQ_VY) ? 0x84 : 0x85, next);
+        block_done = true;
+        break;
+
+      // the rest go through the op_ functions, the ones that use or change PC get it set first
+      // and end the block
+      case OP_INVALID: p = emit_call_op(p, op_invalid, d); break;
+      case OP_CLEAR: p = emit_call_op(p, op_clear, d); break;
+      case OP_RANDOM: p = emit_call_op(p, op_random, d); break;
+      case OP_GET_DELAY: p = emit_call_op(p, op_get_delay, d); break;
+      case OP_SET_DELAY: p = emit_call_op(p, op_set_delay, d); break;
+      case OP_SET_SOUND: p = emit_call_op(p, op_set_sound, d); break;
+      case OP_ADD_I: p = emit_call_op(p, op_add_i, d); break;
+      case OP_FONT: p = emit_call_op(p, op_font, d); break;
+      case OP_LOAD: p = emit_call_op(p, op_load, d); break;
+      case OP_CALL:
+        p = emit_set_pc(p, next);
+        p = emit_call_op(p, op_call, d);
+        p = emit_link(p, dyn, d->NNN);
+        block_done = true;
+        break;
+      case OP_DRAW:
+        p = emit_call_op(p, op_draw, d);
+        p = emit_link(p, dyn, next);
+        block_done = true;
+        break;
+      case OP_RETURN:
+      case OP_JUMP_OFFSET:
+      case OP_SKIP_KEY:
+      case OP_SKIP_NOT_KEY:
+      case OP_GET_KEY:
+        p = emit_set_pc(p, next);
+        switch (d->op) {
+          case OP_RETURN: p = emit_call_op(p, op_return, d); break;
+          case OP_JUMP_OFFSET: p = emit_call_op(p, op_jump_offset, d); break;
+          case OP_SKIP_KEY: p = emit_call_op(p, op_skip_key, d); break;
+          case OP_SKIP_NOT_KEY: p = emit_call_op(p, op_skip_not_key, d); break;
+          case OP_GET_KEY: p = emit_call_op(p, op_get_key_counted, d); break;
+        }
+        if (d->op == OP_GET_KEY) {
+          // back to C, where skip_idle_loop() takes the rest of the budget if it is waiting
+          EMIT(0xE9); // jmp exit
+          EMIT_REL32(dyn->exit);
+        }
+        else {
+          p = emit_dispatch(p, dyn);
+        }
+        block_done = true;
+        break;
+      case OP_BCD:
+      case OP_STORE:
+        p = emit_set_pc(p, next);
+        p = emit_call_op(p, (d->op == OP_BCD) ? op_bcd : op_store, d);
+        // if that wrote over translated code the blocks are stale, go back to C to throw them away
+        EMIT(0x80, 0xBB); // cmp byte [rbx+code_modified], 0
+        EMIT32(offsetof(Chip8Machine, code_modified));
+        EMIT(0x00);
+        EMIT(0x0F, 0x85); // jne exit
+        EMIT_REL32(dyn->exit);
+        p = emit_link(p, dyn, next);
+        block_done = true;
+        break;
+    }
+
+    // stop at the length limit, and at the end of emu_ram (PC doesn't wrap, only the fetch does)
+    if (!block_done && (length == DYNAREC_MAX_BLOCK || next > RAM_ADDRESS_MASK)) {
+      p = emit_link(p, dyn, next);
+      block_done = true;
+    }
+    pc = next;
+  }
+
+  *length_check = length;
+  *length_take = length;
+  dyn->block_length[address] = length;
+  dyn->code_used = p - dyn->code;
+  return true;
+}
+
+#undef EMIT
+#undef EMIT_VALUE
+#undef EMIT16
+#undef EMIT32
+#undef EMIT64
+#undef EMIT_REL32
+
+// runs translated blocks. anything that doesn't fit in a whole block (the end of the budget, or PC
+// past the end of emu_ram) runs on the interpreter
+uint64_t run_instructions_dynarec(Chip8Machine *m, uint64_t count) {
+  if (m->dynarec == NULL) {
+    m->dynarec = create_dynarec(m);
+    if (m->dynarec == NULL) {
+      printf("Could not get executable memory for the dynarec, using the threaded engine\n");
+      ENGINE = ENGINE_THREADED;
+      return run_instructions_threaded(m, count);
+    }
+  }
+  Chip8Dynarec *dyn = m->dynarec;
+  dyn->run_count = count;
+
+  uint64_t remaining = count;
+  while (remaining > 0) {
+    if (m->code_modified) {
+      dynarec_flush(dyn);
+      m->code_modified = 0;
+    }
+
+    remaining -= skip_idle_loop(m, remaining);
+    if (remaining == 0) {
+      break;
+    }
+
+    uint16_t address = m->PC;
+    if (address > RAM_ADDRESS_MASK) {
+      run_next_instruction(m);
+      remaining--;
+      continue;
+    }
+    if (dyn->blocks[address] == NULL && !dynarec_translate(m, dyn, address)) {
+      // the code cache is full, start again with an empty one
+      dynarec_flush(dyn);
+      dynarec_translate(m, dyn, address);
+    }
+    if (dyn->block_length[address] > remaining) {
+      run_instructions_switch(m, remaining);
+      break;
+    }
+    remaining = dyn->enter(m, dyn->blocks, remaining);
+  }
+  return count;
+}
+#endif // HAVE_DYNAREC
+
+// Ahead-of-time compiler. --aot-emit out.c writes the loaded ROM out as C source: the ROM itself,
+// every instruction reachable from PROGRAM_START_BYTE already decoded, and a run function with a
+// label per instruction that calls the op_ functions directly (the operands are constants, so the
+// compiler folds them in). Building with -DAOT_SOURCE='"out.c"' compiles that in as the aot engine,
+// and the embedded ROM is what runs when no rom path is given.
+// Jumps and calls go straight to their label. Returns and BNNN go through a switch on PC, and any
+// address that wasn't compiled runs on the interpreter. If the ROM overwrites any of its compiled
+// code the machine runs on the interpreter from then on.
+
+#define AOT_FORMAT_VERSION 5 // bumped whenever the generated code changes, so stale files don't build
+
+// the name of each op_ function (and of its OP_ value, in capitals)
+static const char *op_names[OP_COUNT] = {
+  [OP_INVALID] = "invalid", [OP_NOP] = "nop", [OP_CLEAR] = "clear", [OP_RETURN] = "return",
+  [OP_JUMP] = "jump", [OP_CALL] = "call", [OP_SKIP_EQ_NN] = "skip_eq_nn", [OP_SKIP_NE_NN] = "skip_ne_nn",
+  [OP_SKIP_EQ_VY] = "skip_eq_vy", [OP_SET_NN] = "set_nn", [OP_ADD_NN] = "add_nn", [OP_SET_VY] = "set_vy",
+  [OP_OR] = "or", [OP_AND] = "and", [OP_XOR] = "xor", [OP_ADD_VY] = "add_vy", [OP_SUB_VY] = "sub_vy",
+  [OP_SHIFT_RIGHT] = "shift_right", [OP_SUB_FROM_VY] = "sub_from_vy", [OP_SHIFT_LEFT] = "shift_left",
+  [OP_SKIP_NE_VY] = "skip_ne_vy", [OP_SET_I] = "set_i", [OP_JUMP_OFFSET] = "jump_offset",
+  [OP_RANDOM] = "random", [OP_DRAW] = "draw", [OP_SKIP_KEY] = "skip_key", [OP_SKIP_NOT_KEY] = "skip_not_key",
+  [OP_GET_DELAY] = "get_delay", [OP_GET_KEY] = "get_key", [OP_SET_DELAY] = "set_delay",
+  [OP_SET_SOUND] = "set_sound", [OP_ADD_I] = "add_i", [OP_FONT] = "font", [OP_BCD] = "bcd",
+  [OP_STORE] = "store", [OP_LOAD] = "load",
+};
+
+static void print_op_enum(FILE *out, uint8_t op) {
+  fprintf(out, "OP_");
+  for (const char *c = op_names[op]; *c != '\0'; c++) {
+    fputc((*c >= 'a' && *c <= 'z') ? *c - 'a' + 'A' : *c, out);
+  }
+}
+
+// continue at address: fall through if its label comes next, otherwise jump to it (or go through
+// the dispatch switch if it wasn't compiled)
+static void print_aot_goto(FILE *out, const bool *reachable, uint16_t address, int next_label, const char *indent) {
+  if (address <= RAM_ADDRESS_MASK && reachable[address]) {
+    if (address != next_label) {
+      fprintf(out, "%sgoto a%03x;\n", indent, address);
+    }
+  }
+  else {
+    fprintf(out, "%sm->PC = 0x%03x;\n%sgoto dispatch;\n", indent, address, indent);
+  }
+}
+
+// write the ROM loaded into m out as C source
+void aot_emit(Chip8Machine *m, const char *rom_name, const char *out_path) {
+  // find the reachable instructions, following both sides of every skip and the return from every call
+  bool *reachable = calloc(RAM_SIZE, sizeof(bool));
+  DecodedInstruction *code = calloc(RAM_SIZE, sizeof(DecodedInstruction));
+  uint16_t *pending = malloc(sizeof(uint16_t) * (RAM_SIZE + 1));
+  int pending_count = 0;
+  pending[pending_count++] = PROGRAM_START_BYTE;
+  while (pending_count > 0) {
+    uint16_t address = pending[--pending_count];
+    if (address > RAM_ADDRESS_MASK || reachable[address]) {
+      continue; // past the end of emu_ram (left to the interpreter) or already seen
+    }
+    reachable[address] = true;
+    code[address] = decode_instruction((m->emu_ram[address] << 8) | m->emu_ram[(address + 1) & RAM_ADDRESS_MASK]);
+
+    const DecodedInstruction *d = &code[address];
+    uint16_t next = address + 2;
+    switch (d->op) {
+      case OP_JUMP:
+        pending[pending_count++] = d->NNN;
+        break;
+      case OP_CALL:
+        pending[pending_count++] = d->NNN;
+        pending[pending_count++] = next;
+        break;
+      case OP_SKIP_EQ_NN:
+      case OP_SKIP_NE_NN:
+      case OP_SKIP_EQ_VY:
+      case OP_SKIP_NE_VY:
+      case OP_SKIP_KEY:
+      case OP_SKIP_NOT_KEY:
+        pending[pending_count++] = next;
+        pending[pending_count++] = next + 2;
+        break;
+      case OP_RETURN:
+      case OP_JUMP_OFFSET:
+        break; // the target is only known at run time
+      default:
+        pending[pending_count++] = next;
+        break;
+    }
+  }
+  free(pending);
+
+  FILE *out = fopen(out_path, "w");
+  if (out == NULL) {
+    printf("Could not open %s for writing\n", out_path);
+    exit(1);
+  }
+
+  // the ROM, without the zeros at the end (emu_ram starts out zeroed anyway)
+  int rom_size = RAM_SIZE - PROGRAM_START_BYTE;
+  while (rom_size > 0 && m->emu_ram[PROGRAM_START_BYTE + rom_size - 1] == 0) {
+    rom_size--;
+  }
+  fprintf(out, "// %s compiled to C by --aot-emit. build the emulator with -DAOT_SOURCE='\"<this file>\"'\n\n", rom_name);
+  fprintf(out, "#define AOT_FORMAT %d\n\n", AOT_FORMAT_VERSION);
+  fprintf(out, "static const char aot_rom_name[] = \"");
+  for (const char *c = rom_name; *c != '\0'; c++) {
+    fprintf(out, (*c == '"' || *c == '\\') ? "\\%c" : "%c", *c);
+  }
+  fprintf(out, "\";\n");
+  fprintf(out, "static const int aot_ram_size = %d;\n", RAM_SIZE);
+  fprintf(out, "static const int aot_start_byte = 0x%03x;\n", PROGRAM_START_BYTE);
+  fprintf(out, "static const int aot_rom_size = %d;\n", rom_size);
+  fprintf(out, "static const uint8_t aot_rom[%d] = {", rom_size > 0 ? rom_size : 1);
+  for (int i = 0; i < rom_size; i++) {
+    fprintf(out, "%s0x%02x,", (i % 16 == 0) ? "\n  " : " ", m->emu_ram[PROGRAM_START_BYTE + i]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "// the reachable instructions, already decoded\n");
+  fprintf(out, "static const DecodedInstruction aot_code[%d] = {\n", RAM_SIZE);
+  for (int address = 0; address < RAM_SIZE; address++) {
+    if (reachable[address]) {
+      const DecodedInstruction *d = &code[address];
+      fprintf(out, "  [0x%03x] = { ", address);
+      print_op_enum(out, d->op);
+      fprintf(out, ", 0x%X, 0x%X, 0x%X, 0x%02X, 0x%03X, 0x%04X },\n", d->X, d->Y, d->N, d->NN, d->NNN, d->instruction);
+    }
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "// the emu_ram bytes they were compiled from, stores into these drop back to the interpreter\n");
+  fprintf(out, "static const uint8_t aot_code_bytes[%d] = {\n", RAM_SIZE);
+  for (int address = 0; address < RAM_SIZE; address++) {
+    if (reachable[address] || reachable[(address - 1) & RAM_ADDRESS_MASK]) {
+      fprintf(out, "  [0x%03x] = 1,\n", address);
+    }
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "uint64_t run_instructions_aot(Chip8Machine *m, uint64_t count) {\n");
+  fprintf(out, "  uint64_t remaining = count;\n");
+  fprintf(out, "  if (!aot_start(m)) {\n    return run_instructions_switch(m, count);\n  }\n\n");
+  fprintf(out, "dispatch:\n  switch (m->PC) {\n");
+  for (int address = 0; address < RAM_SIZE; address++) {
+    if (reachable[address]) {
+      fprintf(out, "    case 0x%03x: goto a%03x;\n", address, address);
+    }
+  }
+  fprintf(out, "    default: AOT_INTERPRET();\n  }\n\n");
+
+  for (int address = 0; address < RAM_SIZE; address++) {
+    if (!reachable[address]) {
+      continue;
+    }
+    int next_label = -1;
+    for (int later = address + 1; later < RAM_SIZE; later++) {
+      if (reachable[later]) {
+        next_label = later;
+        break;
+      }
+    }
+
+    const DecodedInstruction *d = &code[address];
+    const char *name = op_names[d->op];
+    uint16_t next = address + 2;
+    fprintf(out, "a%03x: // %04X\n  AOT_STEP(0x%03x);\n", address, d->instruction, address);
+    if (d->touches_vf) {
+      fprintf(out, "  materialize_vf(m);\n");
+    }
+    switch (d->op) {
+      case OP_NOP:
+        print_aot_goto(out, reachable, next, next_label, "  ");
+        break;
+      case OP_JUMP:
+        if (is_idle_loop_jump(m, address, d->NNN)) {
+          // the pass that just went round was idle (for a delay loop only if this run started
+          // before it, as the interpreter's fused op only counts whole passes)
+          if (d->NNN == address) {
+            fprintf(out, "  m->idle_instructions++;\n");
+          }
+          else {
+            fprintf(out, "  if (count - remaining >= 3) {\n    m->idle_instructions += 3;\n  }\n");
+          }
+          fprintf(out, "  m->PC = 0x%03x;\n  remaining -= skip_idle_loop(m, remaining);\n", d->NNN);
+        }
+        print_aot_goto(out, reachable, d->NNN, next_label, "  ");
+        break;
+      case OP_CALL:
+        fprintf(out, "  m->PC = 0x%03x;\n  op_call(m, &aot_code[0x%03x]);\n", next, address);
+        print_aot_goto(out, reachable, d->NNN, next_label, "  ");
+        break;
+      case OP_SKIP_EQ_NN:
+      case OP_SKIP_NE_NN:
+      case OP_SKIP_EQ_VY:
+      case OP_SKIP_NE_VY:
+      case OP_SKIP_KEY:
+      case OP_SKIP_NOT_KEY:
+        fprintf(out, "  m->PC = 0x%03x;\n  op_%s(m, &aot_code[0x%03x]);\n", next, name, address);
+        fprintf(out, "  if (m->PC != 0x%03x) {\n", next);
+        print_aot_goto(out, reachable, next + 2, -1, "    ");
+        fprintf(out, "  }\n");
+        print_aot_goto(out, reachable, next, next_label, "  ");
+        break;
+      case OP_RETURN:
+      case OP_JUMP_OFFSET:
+        fprintf(out, "  m->PC = 0x%03x;\n  op_%s(m, &aot_code[0x%03x]);\n  goto dispatch;\n", next, name, address);
+        break;
+      case OP_GET_KEY:
+        fprintf(out, "  m->PC = 0x%03x;\n  op_get_key_counted(m, &aot_code[0x%03x]);\n", next, address);
+        fprintf(out, "  remaining -= skip_idle_loop(m, remaining);\n  goto dispatch;\n");
+        break;
+      case OP_BCD:
+      case OP_STORE:
+        fprintf(out, "  m->PC = 0x%03x;\n  op_%s(m, &aot_code[0x%03x]);\n  AOT_CHECK_MODIFIED();\n", next, name, address);
+        print_aot_goto(out, reachable, next, next_label, "  ");
+        break;
+      default:
+        fprintf(out, "  op_%s(m, &aot_code[0x%03x]);\n", name, address);
+        print_aot_goto(out, reachable, next, next_label, "  ");
+        break;
+    }
+  }
+  fprintf(out, "}\n");
+  fclose(out);
+
+  free(reachable);
+  free(code);
+}
+
+#ifdef AOT_SOURCE
+static bool aot_start(Chip8Machine *m);
+
+// the pieces of the generated run function that aren't particular to one ROM
+#define AOT_STEP(address) \
+  do { \
+    if (remaining == 0) { \
+      m->PC = (address); \
+      materialize_vf(m); \
+      return count; \
+    } \
+    remaining--; \
+  } while (0)
+// run the instruction at PC on the interpreter, it wasn't compiled
+#define AOT_INTERPRET() \
+  do { \
+    if (remaining == 0) { \
+      materialize_vf(m); \
+      return count; \
+    } \
+    run_next_instruction(m); \
+    remaining--; \
+    goto dispatch; \
+  } while (0)
+// a store just overwrote compiled code, run the rest on the interpreter
+#define AOT_CHECK_MODIFIED() \
+  do { \
+    if (m->code_modified) { \
+      return count - remaining + run_instructions_switch(m, remaining); \
+    } \
+  } while (0)
+
+#include AOT_SOURCE
+#if !defined(AOT_FORMAT) || AOT_FORMAT != AOT_FORMAT_VERSION
+#error "AOT_SOURCE was written by an older --aot-emit, write it again"
+#endif
+
+#undef AOT_STEP
+#undef AOT_INTERPRET
+#undef AOT_CHECK_MODIFIED
+
+// the first time a machine runs on the aot engine, check it holds the ROM that was compiled in.
+// returns false once the compiled code can't be trusted (a different ROM, or the ROM has
+// overwritten some of its code)
+static bool aot_start(Chip8Machine *m) {
+  if (m->translated != aot_code_bytes) {
+    m->translated = aot_code_bytes;
+    m->code_modified = 0;
+    if (aot_ram_size != RAM_SIZE || aot_start_byte != PROGRAM_START_BYTE ||
+        memcmp(&m->emu_ram[PROGRAM_START_BYTE], aot_rom, aot_rom_size) != 0) {
+      printf("The loaded rom isn't the compiled in %s, using the interpreter\n", aot_rom_name);
+      m->code_modified = 1;
+    }
+  }
+  return !m->code_modified;
+}
+
+// load the ROM that was compiled in
+void load_aot_rom(Chip8Machine *m) {
+  memcpy(&m->emu_ram[PROGRAM_START_BYTE], aot_rom, aot_rom_size);
+  invalidate_decoded(m);
+}
+#endif // AOT_SOURCE
+
+// run count instructions with whichever engine ENGINE picks
+uint64_t run_instructions(Chip8Machine *m, uint64_t count) {
+#ifdef AOT_SOURCE
+  if (ENGINE == ENGINE_AOT) {
+    return run_instructions_aot(m, count);
+  }
+#endif // AOT_SOURCE
+#ifdef HAVE_DYNAREC
+  if (ENGINE == ENGINE_DYNAREC) {
+    return run_instructions_dynarec(m, count);
+  }
+#endif // HAVE_DYNAREC
+#ifdef __GNUC__
+  if (ENGINE == ENGINE_THREADED) {
+    return run_instructions_threaded(m, count);
+  }
+#endif // __GNUC__
+  return run_instructions_switch(m, count);
+}
+
+static void initialize_emu_ram(Chip8Machine *m) {
+    // load font
+    memcpy(&m->emu_ram[FONT_START_BYTE], &font, 80*sizeof(*font));
+}
+
+// load rom file into emu_ram
+void load_rom(Chip8Machine *m, char *rom) {
+    FILE *rom_file = fopen(rom, "rb");
+    if (rom_file == NULL) {
+        printf("Could not open rom file %s\n", rom);
+        exit(1);
+    }
+    char *rom_data;
+    size_t rom_size = 0;
+    int suc = readall(rom_file, &rom_data, &rom_size);
+    fclose(rom_file);
+    //printf("Rom size: %d\n", rom_size);
+    //printf("Rom status: %d\n", suc);
+    if (suc != READALL_OK) {
+        printf("Could not read rom file %s\n", rom);
+        exit(1);
+    }
+
+    // everything from PROGRAM_START_BYTE to the end of emu_ram is free for the program (3.5KB)
+    if (rom_size > (size_t)(RAM_SIZE - PROGRAM_START_BYTE)) {
+        printf("Rom is too big (%d bytes, the most that fits is %d)\n", (int)rom_size, RAM_SIZE - PROGRAM_START_BYTE);
+        exit(1);
+    }
+    memcpy(&m->emu_ram[PROGRAM_START_BYTE], rom_data, rom_size);
+    free(rom_data);
+    invalidate_decoded(m);
+}
+
+// load the rom file, or the compiled in ROM when there is one and no file was given
+void load_program(Chip8Machine *m, char *rom) {
+#ifdef AOT_SOURCE
+    if (rom == NULL) {
+        load_aot_rom(m);
+        return;
+    }
+#endif // AOT_SOURCE
+    load_rom(m, rom);
+}
+
+#ifndef HEADLESS
+// The screen is converted to pixels a byte of display row (8 pixels) at a time.
+// pixel_lut holds the 8 pixels for every possible byte, already in the texture's byte order
+uint32_t pixel_colors[2]; // the palette in texture byte order (RGBA32 is R, G, B, A in memory)
+uint32_t pixel_lut[256][8];
+
+// the last SCREEN_WIDTH % 8 pixels of a row, when the width isn't a whole number of bytes
+static void expand_row_tail(uint32_t *pixels, uint64_t row) {
+    int whole_bytes = SCREEN_WIDTH / 8;
+    int leftover = SCREEN_WIDTH % 8;
+    if (leftover > 0) {
+        memcpy(&pixels[whole_bytes * 8], pixel_lut[(row >> (56 - whole_bytes * 8)) & 0xFF], leftover * sizeof(uint32_t));
+    }
+}
+
+// expand one display row into SCREEN_WIDTH pixels using the lookup table. an AVX2 version (one
+// compare and blend per byte) and an SSE2 one were both measured, and neither beat the table
+static void expand_row(uint32_t *pixels, uint64_t row) {
+    for (int i = 0; i < SCREEN_WIDTH / 8; i++) {
+        memcpy(&pixels[i * 8], pixel_lut[(row >> (56 - i * 8)) & 0xFF], sizeof(pixel_lut[0]));
+    }
+    expand_row_tail(pixels, row);
+}
+
+// fill the lookup table from the palette
+void initialize_pixel_conversion() {
+    pixel_colors[0] = SDL_SwapBE32(palette[0]);
+    pixel_colors[1] = SDL_SwapBE32(palette[1]);
+
+    for (int byte = 0; byte < 256; byte++) {
+        for (int bit_offset = 0; bit_offset < 8; bit_offset++) {
+            pixel_lut[byte][bit_offset] = pixel_colors[(byte >> (7 - bit_offset)) & 1];
+        }
+    }
+}
+
+// expand the changed rows (bit n of dirty_rows for row n) straight into the texture. each run of
+// neighbouring dirty rows is locked and written in place, stepping by the texture's pitch (which can
+// be wider than SCREEN_WIDTH * 4)
+void update_screen_texture(const uint64_t *rows, uint64_t dirty_rows) {
+    int y = 0;
+    while (y < SCREEN_HEIGHT) {
+        if (((dirty_rows >> y) & 1) == 0) {
+            y++;
+            continue;
+        }
+
+        int run_start = y;
+        while (y < SCREEN_HEIGHT && ((dirty_rows >> y) & 1)) {
+            y++;
+        }
+
+        SDL_Rect rows_rect = {0, run_start, SCREEN_WIDTH, y - run_start};
+        int texture_pitch = 0;
+        void* texture_pixels = NULL;
+        if (SDL_LockTexture(screen_tex, &rows_rect, &texture_pixels, &texture_pitch) != 0) {
+            SDL_Log("Unable to lock texture: %s", SDL_GetError());
+            continue;
+        }
+
+        for (int row = run_start; row < y; row++) {
+            expand_row((uint32_t *)((uint8_t *)texture_pixels + (row - run_start) * texture_pitch), rows[row]);
+        }
+        SDL_UnlockTexture(screen_tex);
+    }
+}
+
+// Draws the changed rows of the screen and presents it (on the main thread, see run_window())
+void present_screen(const uint64_t *rows, uint64_t dirty_rows) {
+    update_screen_texture(rows, dirty_rows);
+
+    SDL_RenderClear(screen_ren);
+    SDL_RenderCopy(screen_ren, screen_tex, NULL, NULL);
+    SDL_RenderPresent(screen_ren);
+}
+#else
+// headless builds have no window, the machine's display_rows are the whole screen. presenting
+// just marks them clean, so the frame counts come out the same as with a window
+bool draw_frame(Chip8Machine *m) {
+    if (m->dirty_rows == 0) {
+        return false;
+    }
+
+    m->dirty_rows = 0;
+    return true;
+}
+#endif // HEADLESS
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// current time in nanoseconds on a monotonic clock. the starting point is arbitrary, only
+// differences between two calls mean anything, but it never jumps when the system time changes
+#ifdef _WIN32
+uint64_t get_clock_time() {
+    static LARGE_INTEGER tick_per_second;
+    if (tick_per_second.QuadPart == 0) {
+        QueryPerformanceFrequency(&tick_per_second);
+    }
+
+    LARGE_INTEGER tick;
+    QueryPerformanceCounter(&tick);
+
+    // split into whole seconds and the remainder so the multiply can't overflow
+    uint64_t seconds = tick.QuadPart / tick_per_second.QuadPart;
+    uint64_t remainder = tick.QuadPart % tick_per_second.QuadPart;
+    return seconds * NSEC_PER_SEC + remainder * NSEC_PER_SEC / tick_per_second.QuadPart;
+}
+#else
+uint64_t get_clock_time() {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+            printf("Time get error\n");
+            perror("clock_gettime");
+            exit(EXIT_FAILURE);
+    }
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+#endif // _WIN32
+
+// sleep the calling thread until get_clock_time() reaches deadline (returns straight away if it already has)
+#ifdef _WIN32
+void sleep_until(uint64_t deadline) {
+    uint64_t now = get_clock_time();
+    if (now >= deadline) {
+        return;
+    }
+    DWORD ms = (DWORD)((deadline - now) / 1000000);
+    if (ms > 0) {
+        Sleep(ms);
+    }
+}
+#else
+void sleep_until(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+    // restart if a signal wakes us early
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+#endif // _WIN32
+
+// the clock the main loop runs frames by, and its wait for the next frame. headless builds keep a
+// virtual clock that jumps straight to each deadline instead of sleeping, so a run goes as fast as
+// the host allows and still sees the same frame timing as one in real time
+#ifdef HEADLESS
+uint64_t virtual_clock_time;
+
+uint64_t get_frame_clock() {
+    return virtual_clock_time;
+}
+
+void wait_for_frame(uint64_t deadline) {
+    if (virtual_clock_time < deadline) {
+        virtual_clock_time = deadline;
+    }
+}
+#else
+uint64_t get_frame_clock() {
+    return get_clock_time();
+}
+
+void wait_for_frame(uint64_t deadline) {
+    sleep_until(deadline);
+}
+#endif // HEADLESS
+
+// Emulated time is counted in frames of 1/TIMER_FREQUENCY seconds. Both of these work out their
+// result from the frame number instead of adding a per-frame step to a running total, so there is
+// no rounding error to build up and any IPS (not just ones that divide evenly) is held exactly.
+
+uint64_t ips_start_frame; // the frame IPS last changed at (see set_ips())
+uint64_t ips_start_instructions; // and the instructions that had run by the time it started
+
+// number of instructions that have run by the time the given frame starts
+uint64_t instructions_before_frame(uint64_t frame) {
+    return ips_start_instructions + (frame - ips_start_frame) * (uint64_t)IPS / (uint64_t)TIMER_FREQUENCY;
+}
+
+// change IPS from the given frame on. the frames before it keep the instructions they had, so
+// the counting starts again from there
+void set_ips(int ips, uint64_t frame) {
+    ips_start_instructions = instructions_before_frame(frame);
+    ips_start_frame = frame;
+    IPS = ips;
+}
+
+// time (in nanoseconds after the first frame) that the given frame starts at
+uint64_t frame_start_time(uint64_t frame) {
+    return frame * NSEC_PER_SEC / (uint64_t)TIMER_FREQUENCY;
+}
+
+// frame_start_time() with emulated time running speed times as fast (see SPEED), 0 when it is unlimited
+uint64_t scaled_frame_time(uint64_t frame, double speed) {
+    return (speed > 0) ? (uint64_t)(frame_start_time(frame) / speed) : 0;
+}
+
+// how many frames a run without a window lasts
+uint64_t unattended_run_frames() {
+    return (RUN_FRAMES > 0) ? (uint64_t)RUN_FRAMES : 60 * (uint64_t)TIMER_FREQUENCY; // a minute of emulated time
+}
+
+// FNV-1a hash of the screen, so runs can be told apart at a glance
+static uint64_t display_hash(Chip8Machine *m) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        for (int byte = 0; byte < 8; byte++) {
+            hash = (hash ^ ((m->display_rows[y] >> (byte * 8)) & 0xFF)) * 0x100000001b3;
+        }
+    }
+    return hash;
+}
+
+// one line with where the machine ended up, for runs without a window
+void print_machine_state(Chip8Machine *m) {
+    printf("PC %03X I %03X V", m->PC, m->I);
+    for (int x = 0; x < 16; x++) {
+        printf(" %02X", m->V[x]);
+    }
+    printf(" screen %016llx\n", (unsigned long long)display_hash(m));
+}
+
+#ifdef __GNUC__
+// Ensembles. Bulk runs often play the same ROM many times over with different inputs, so an
+// ensemble runs up to ENSEMBLE_LANES machines in lockstep. Their registers, PCs and Is are kept
+// as vectors with one lane per machine (V[0] holds V0 of every machine, and so on), and each step
+// runs one instruction on every lane at the same PC: register operations, skips, jumps, calls,
+// timers and key checks are a few vector instructions for all of those lanes at once, with the
+// lanes at other PCs masked out. Lanes whose PCs have split apart run in turns. A step runs the
+// group at the PC of the lead lane (the first one with budget left), and groups join up again as
+// soon as their PCs meet, e.g. at the instruction after a skip. Everything else (drawing, memory,
+// random numbers) runs lane by lane through run_op() on the lane's own machine, so an ensemble
+// ends up exactly where its machines would have run one at a time.
+//
+// That makes the vector engine a win only for code that is mostly register operations, jumps and
+// timer or key checks. Drawing and memory go lane by lane with the registers copied out and back
+// around each one, so a ROM that draws all the time, or whose lanes have split apart, runs slower
+// than it would one machine after another. So an ensemble keeps timing itself both ways (see
+// run_ensemble()) and runs its machines one at a time through the normal engine while that is faster.
+
+#define ENSEMBLE_LANES 32 // most machines in one ensemble, one byte register of all of them fills a 256 bit register
+#define ENSEMBLE_STACK_SIZE 16 // most stack entries an ensemble's machines can have
+
+// every lane value is a byte, so each vector is one register and the comparisons stay vector
+// instructions (wider ones get split up lane by lane)
+typedef uint8_t LaneBytes __attribute__((vector_size(ENSEMBLE_LANES)));
+typedef int8_t LaneMask __attribute__((vector_size(ENSEMBLE_LANES))); // -1 in the lanes taking part, 0 in the rest
+
+// one lane of a vector in memory. going through a byte pointer keeps this a single byte load or
+// store (indexing the vector itself can read and write back the whole vector)
+#define LANE(vector, lane) (((uint8_t *)&(vector))[lane])
+
+typedef struct Chip8Ensemble {
+    LaneBytes V[16];
+    LaneBytes PC_low; // PC and I are split into their low and high bytes
+    LaneBytes PC_high;
+    LaneBytes I_low;
+    LaneBytes I_high;
+    LaneBytes delay_timer;
+    LaneBytes sound_timer;
+    LaneBytes stack_top; // emu_stack_top, so -1 (255) when the stack is empty
+    LaneBytes stack_low[ENSEMBLE_STACK_SIZE];
+    LaneBytes stack_high[ENSEMBLE_STACK_SIZE];
+    LaneBytes keys[16]; // keypad_states, which only change between runs
+    LaneBytes remaining; // instructions each lane has left to run in this piece of the run
+    LaneBytes idle_instructions; // each lane's idle_instructions and timer_polls in this piece of the
+    LaneBytes timer_polls; // run, added to its machine's once the piece is done
+    int whole_pass_limit; // a lane with at most this much of the piece left has run 3 or more instructions of the run (-1 if none has)
+
+    int lanes;
+    Chip8Machine *machines[ENSEMBLE_LANES]; // the rest of each lane's state. V, PC and I are copied in and out by run_ensemble()
+    uint8_t *written; // nonzero for each emu_ram byte that may differ between lanes, instructions there are fetched lane by lane
+    DecodedInstruction *decoded; // the decodes of the addresses that are the same in every lane
+    Chip8Profile profile;
+    uint64_t (*run)(struct Chip8Ensemble *e, uint64_t count); // the build of run_ensemble_with() for this CPU
+
+    uint64_t runs; // calls to run_ensemble() so far
+    uint64_t vector_runs; // the ones that went through the vector engine, for the summary
+    bool one_by_one; // the last trial found running the machines one at a time faster
+    bool out_of_sync; // machines have run on their own since decoded and written were last worked out
+    uint64_t trial_time[2]; // nanoseconds the vector [0] and one at a time [1] runs of the current trial took
+    uint64_t trial_count[2]; // and how many instructions they ran
+} Chip8Ensemble;
+
+// the registers op d can read or write, bit n for Vn
+static uint16_t registers_used(const DecodedInstruction *d) {
+  switch (d->op) {
+    case OP_STORE:
+    case OP_LOAD:
+      return (2 << d->X) - 1; // V0 to VX
+    case OP_JUMP_OFFSET:
+      return 1 | (1 << d->X);
+    default:
+      return (1 << d->X) | (1 << d->Y) | (1 << 0xF); // the most any other op uses (DXYN sets VF)
+  }
+}
+
+// the lane's registers (the ones in used), PC and I from the vectors into its machine, and back
+static void ensemble_save_registers(Chip8Ensemble *e, int lane, uint16_t used) {
+  Chip8Machine *m = e->machines[lane];
+  for (uint32_t bits = used; bits != 0; bits &= bits - 1) {
+    int x = __builtin_ctz(bits);
+    m->V[x] = LANE(e->V[x], lane);
+  }
+  m->PC = LANE(e->PC_low, lane) | (LANE(e->PC_high, lane) << 8);
+  m->I = LANE(e->I_low, lane) | (LANE(e->I_high, lane) << 8);
+}
+
+static void ensemble_load_registers(Chip8Ensemble *e, int lane, uint16_t used) {
+  Chip8Machine *m = e->machines[lane];
+  for (uint32_t bits = used; bits != 0; bits &= bits - 1) {
+    int x = __builtin_ctz(bits);
+    LANE(e->V[x], lane) = m->V[x];
+  }
+  LANE(e->PC_low, lane) = m->PC & 0xFF;
+  LANE(e->PC_high, lane) = m->PC >> 8;
+  LANE(e->I_low, lane) = m->I & 0xFF;
+  LANE(e->I_high, lane) = m->I >> 8;
+}
+
+// the same with the timers and stack as well, and the keys on the way in
+static void ensemble_save_lane(Chip8Ensemble *e, int lane) {
+  Chip8Machine *m = e->machines[lane];
+  ensemble_save_registers(e, lane, 0xFFFF);
+  set_delay_timer(m, LANE(e->delay_timer, lane));
+  set_sound_timer(m, LANE(e->sound_timer, lane));
+  m->emu_stack_top = (int8_t)LANE(e->stack_top, lane);
+  for (int i = 0; i <= m->emu_stack_top; i++) {
+    m->emu_stack[i] = LANE(e->stack_low[i], lane) | (LANE(e->stack_high[i], lane) << 8);
+  }
+}
+
+static void ensemble_load_lane(Chip8Ensemble *e, int lane) {
+  Chip8Machine *m = e->machines[lane];
+  ensemble_load_registers(e, lane, 0xFFFF);
+  LANE(e->delay_timer, lane) = get_delay_timer(m);
+  LANE(e->sound_timer, lane) = get_sound_timer(m);
+  LANE(e->stack_top, lane) = (uint8_t)m->emu_stack_top;
+  for (int i = 0; i <= m->emu_stack_top; i++) {
+    LANE(e->stack_low[i], lane) = m->emu_stack[i] & 0xFF;
+    LANE(e->stack_high[i], lane) = m->emu_stack[i] >> 8;
+  }
+  for (int key = 0; key < 16; key++) {
+    LANE(e->keys[key], lane) = m->keypad_states[key];
+  }
+}
+
+// run the instruction at the lanes' PC (d, already decoded) on each of their machines in turn
+static void run_ensemble_lanes(Chip8Ensemble *e, const LaneMask *active, const DecodedInstruction *d) {
+  uint16_t mask = e->profile.ram_size - 1;
+  uint16_t used = registers_used(d);
+  for (int lane = 0; lane < e->lanes; lane++) {
+    if (LANE(*active, lane) == 0) {
+      continue;
+    }
+    Chip8Machine *m = e->machines[lane];
+    // only calls and returns (the ones that overflow the stack) touch more than the registers
+    bool stack = d->op == OP_CALL || d->op == OP_RETURN;
+    if (stack) {
+      ensemble_save_lane(e, lane);
+    }
+    else {
+      ensemble_save_registers(e, lane, used);
+    }
+
+    // what a store is about to write can now differ from the other lanes
+    int stored = (d->op == OP_BCD) ? 3 : (d->op == OP_STORE) ? d->X + 1 : 0;
+    for (int i = 0; i < stored; i++) {
+      e->written[(m->I + i) & mask] = 1;
+    }
+
+    run_op(m, d, &e->profile, 1);
+    materialize_vf(m);
+    if (d->op == OP_GET_KEY && m->get_key_status == 1) {
+      // waiting for a key, which can't come until the run is over. run_op() counted this one as idle
+      m->idle_instructions += LANE(e->remaining, lane);
+      LANE(e->remaining, lane) = 0;
+    }
+    if (stack) {
+      ensemble_load_lane(e, lane);
+    }
+    else {
+      ensemble_load_registers(e, lane, used);
+    }
+  }
+}
+
+// lane by lane blends, the lanes outside the mask keep their old value
+#define SET_LANES(target, lanes, value) ((target) = ((target) & ~(lanes)) | ((value) & (lanes)))
+#define BROADCAST(value) ((LaneBytes){0} + (uint8_t)(value))
+
+// true if any lane of v is nonzero
+static ALWAYS_INLINE bool any_lanes(const LaneBytes *v) {
+  uint64_t words[ENSEMBLE_LANES / 8];
+  memcpy(words, v, sizeof(words));
+  uint64_t any = 0;
+  for (int i = 0; i < ENSEMBLE_LANES / 8; i++) {
+    any |= words[i];
+  }
+  return any != 0;
+}
+
+// run one instruction on the lead lane and every other lane at the same PC. quirks and sizes come from q
+static ALWAYS_INLINE void run_ensemble_step(Chip8Ensemble *e, int lead, const Chip8Profile *q) {
+  uint16_t pc = LANE(e->PC_low, lead) | (LANE(e->PC_high, lead) << 8);
+  uint16_t address = pc & (q->ram_size - 1);
+  uint16_t second = (address + 1) & (q->ram_size - 1);
+  LaneMask active = (e->PC_low == BROADCAST(pc)) & (e->PC_high == BROADCAST(pc >> 8)) & (e->remaining != 0);
+
+  const DecodedInstruction *d;
+  DecodedInstruction fetched;
+  if (e->written[address] | e->written[second]) {
+    // the lanes may have different instructions here, only the ones that match the lead lane's run
+    uint16_t instruction = fetch_instruction(e->machines[lead], address);
+    for (int lane = 0; lane < e->lanes; lane++) {
+      if (LANE(active, lane) != 0 && fetch_instruction(e->machines[lane], address) != instruction) {
+        LANE(active, lane) = 0;
+      }
+    }
+    fetched = decode_instruction(instruction);
+    d = &fetched;
+  }
+  else {
+    if (e->decoded[address].op == OP_UNDECODED) {
+      e->decoded[address] = decode_instruction(fetch_instruction(e->machines[lead], address));
+    }
+    d = &e->decoded[address];
+  }
+  LaneBytes lanes = (LaneBytes)active;
+  e->remaining -= lanes & 1;
+
+  // everything at one PC ends up at one of two PCs, the next instruction or the one after it
+  uint16_t next = pc + 2;
+  uint16_t skipped = pc + 4;
+  LaneBytes vx = e->V[d->X];
+  LaneBytes vy = e->V[d->Y];
+  LaneBytes result;
+  LaneBytes flag;
+  LaneBytes skip;
+
+  switch (d->op) {
+    case OP_NOP: goto set_pc;
+    case OP_JUMP:
+      if (d->NNN == pc) {
+        // jumping to itself, it would do nothing else for the rest of this run (see skip_idle_loop()),
+        // so that and this jump are idle
+        e->idle_instructions += (e->remaining + 1) & lanes;
+        e->remaining &= ~lanes;
+      }
+      else if (d->NNN + 4 == pc && is_idle_loop_jump(e->machines[lead], pc, d->NNN)) {
+        // an FX07 3XNN 1NNN loop going round, idle if the whole pass was in this run (see op_delay_wait())
+        LaneBytes whole = (e->whole_pass_limit < 0) ? BROADCAST(0) : (LaneBytes)(e->remaining <= BROADCAST(e->whole_pass_limit));
+        e->idle_instructions += lanes & whole & 3;
+      }
+      next = d->NNN;
+      goto set_pc;
+    case OP_SKIP_EQ_NN: skip = (LaneBytes)(vx == d->NN); break;
+    case OP_SKIP_NE_NN: skip = (LaneBytes)(vx != d->NN); break;
+    case OP_SKIP_EQ_VY: skip = (LaneBytes)(vx == vy); break;
+    case OP_SKIP_NE_VY: skip = (LaneBytes)(vx != vy); break;
+    case OP_SET_NN: result = BROADCAST(d->NN); goto set_vx;
+    case OP_ADD_NN: result = vx + d->NN; goto set_vx;
+    case OP_SET_VY: result = vy; goto set_vx;
+    case OP_OR: result = vx | vy; goto set_vx;
+    case OP_AND: result = vx & vy; goto set_vx;
+    case OP_XOR: result = vx ^ vy; goto set_vx;
+    case OP_ADD_VY:
+      result = vx + vy;
+      flag = (LaneBytes)(result < vx) & 1;
+      goto set_vx_vf;
+    case OP_SUB_VY:
+      result = vx - vy;
+      flag = (LaneBytes)(vx >= vy) & 1;
+      goto set_vx_vf;
+    case OP_SUB_FROM_VY:
+      result = vy - vx;
+      flag = (LaneBytes)(vy >= vx) & 1;
+      goto set_vx_vf;
+    case OP_SHIFT_RIGHT:
+    {
+      LaneBytes shifted = (q->copy_shift == 1) ? vy : vx;
+      result = shifted >> 1;
+      flag = shifted & 1;
+      goto set_vx_vf;
+    }
+    case OP_SHIFT_LEFT:
+    {
+      LaneBytes shifted = (q->copy_shift == 1) ? vy : vx;
+      result = shifted << 1;
+      flag = shifted >> 7;
+      goto set_vx_vf;
+    }
+    case OP_SET_I:
+      SET_LANES(e->I_low, lanes, BROADCAST(d->NNN));
+      SET_LANES(e->I_high, lanes, BROADCAST(d->NNN >> 8));
+      goto set_pc;
+    case OP_ADD_I:
+    {
+      LaneBytes low = e->I_low + vx;
+      LaneBytes high = e->I_high + ((LaneBytes)(low < vx) & 1);
+      SET_LANES(e->I_low, lanes, low);
+      SET_LANES(e->I_high, lanes, high);
+      SET_LANES(e->V[0xF], lanes & (LaneBytes)(high >= 0x10), BROADCAST(1)); // left past 0xFFF
+      goto set_pc;
+    }
+    case OP_GET_DELAY:
+      e->timer_polls += lanes & 1;
+      result = e->delay_timer;
+      goto set_vx;
+    case OP_SET_DELAY:
+      SET_LANES(e->delay_timer, lanes, vx);
+      goto set_pc;
+    case OP_SET_SOUND:
+      SET_LANES(e->sound_timer, lanes, vx);
+      goto set_pc;
+    case OP_SKIP_KEY:
+    case OP_SKIP_NOT_KEY:
+    {
+      LaneBytes invalid = lanes & (LaneBytes)(vx > 0xF);
+      if (any_lanes(&invalid)) {
+        run_ensemble_lanes(e, &active, d); // the warning is printed lane by lane
+        return;
+      }
+      LaneBytes state = BROADCAST(0);
+      for (int key = 0; key < 16; key++) {
+        state |= (LaneBytes)(vx == BROADCAST(key)) & e->keys[key];
+      }
+      skip = (LaneBytes)(state == BROADCAST((d->op == OP_SKIP_KEY) ? 1 : 0));
+      break;
+    }
+    case OP_CALL:
+    {
+      uint8_t top = LANE(e->stack_top, lead);
+      LaneBytes uneven = lanes & (LaneBytes)(e->stack_top != BROADCAST(top));
+      if (any_lanes(&uneven) || (int8_t)top >= q->stack_size - 1) {
+        run_ensemble_lanes(e, &active, d); // the stacks are at different depths, or full
+        return;
+      }
+      top++;
+      SET_LANES(e->stack_low[top], lanes, BROADCAST(next));
+      SET_LANES(e->stack_high[top], lanes, BROADCAST(next >> 8));
+      SET_LANES(e->stack_top, lanes, BROADCAST(top));
+      next = d->NNN;
+      goto set_pc;
+    }
+    case OP_RETURN:
+    {
+      uint8_t top = LANE(e->stack_top, lead);
+      LaneBytes uneven = lanes & (LaneBytes)(e->stack_top != BROADCAST(top));
+      if (any_lanes(&uneven) || (int8_t)top < 0) {
+        run_ensemble_lanes(e, &active, d); // the stacks are at different depths, or empty
+        return;
+      }
+      SET_LANES(e->PC_low, lanes, e->stack_low[top]);
+      SET_LANES(e->PC_high, lanes, e->stack_high[top]);
+      SET_LANES(e->stack_top, lanes, BROADCAST(top - 1));
+      return;
+    }
+    default:
+      run_ensemble_lanes(e, &active, d);
+      return;
+  }
+
+  // skips
+  SET_LANES(e->PC_low, lanes, BROADCAST(next) ^ (skip & BROADCAST(next ^ skipped)));
+  SET_LANES(e->PC_high, lanes, BROADCAST(next >> 8) ^ (skip & BROADCAST((next ^ skipped) >> 8)));
+  return;
+
+set_vx_vf:
+  // VX is written before VF, so 8FY4 and the like end up holding the flag
+  SET_LANES(e->V[d->X], lanes, result);
+  SET_LANES(e->V[0xF], lanes, flag);
+  goto set_pc;
+set_vx:
+  SET_LANES(e->V[d->X], lanes, result);
+set_pc:
+  SET_LANES(e->PC_low, lanes, BROADCAST(next));
+  SET_LANES(e->PC_high, lanes, BROADCAST(next >> 8));
+}
+
+// runs count instructions on every lane. always inlined, so each build of it below is vectorised
+// for its instruction set
+static ALWAYS_INLINE uint64_t run_ensemble_with(Chip8Ensemble *e, uint64_t count) {
+  for (int lane = 0; lane < e->lanes; lane++) {
+    ensemble_load_lane(e, lane);
+  }
+  uint64_t left = count;
+  while (left > 0) {
+    // the budgets are bytes too, so a run goes in pieces of at most 255 instructions
+    uint8_t piece = (left > 0xFF) ? 0xFF : left;
+    uint64_t ran = count - left; // before this piece
+    left -= piece;
+    for (int lane = 0; lane < ENSEMBLE_LANES; lane++) {
+      LANE(e->remaining, lane) = (lane < e->lanes) ? piece : 0;
+    }
+    e->whole_pass_limit = (ran + piece >= 3 + 0xFF) ? 0xFF : (int)(ran + piece) - 3;
+    // the lanes before the lead lane have all finished, so it only ever moves forward
+    int lead = 0;
+    while (true) {
+      while (lead < e->lanes && LANE(e->remaining, lead) == 0) {
+        lead++;
+      }
+      if (lead == e->lanes) {
+        break;
+      }
+      run_ensemble_step(e, lead, &e->profile);
+    }
+
+    for (int lane = 0; lane < e->lanes; lane++) {
+      e->machines[lane]->idle_instructions += LANE(e->idle_instructions, lane);
+      e->machines[lane]->timer_polls += LANE(e->timer_polls, lane);
+    }
+    e->idle_instructions = BROADCAST(0);
+    e->timer_polls = BROADCAST(0);
+  }
+  for (int lane = 0; lane < e->lanes; lane++) {
+    ensemble_save_lane(e, lane);
+  }
+  return count;
+}
+
+// without AVX2 the compiler splits the 256 bit vectors up into smaller pieces, so this build is
+// only there for CPUs that have nothing better and is no faster than running the machines one by one
+static uint64_t run_ensemble_generic(Chip8Ensemble *e, uint64_t count) {
+  return run_ensemble_with(e, count);
+}
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static uint64_t run_ensemble_avx2(Chip8Ensemble *e, uint64_t count) {
+  return run_ensemble_with(e, count);
+}
+__attribute__((target("avx512bw,avx512vl")))
+static uint64_t run_ensemble_avx512(Chip8Ensemble *e, uint64_t count) {
+  return run_ensemble_with(e, count);
+}
+#endif // HAVE_X86_SIMD
+
+// work out which emu_ram bytes differ between the machines (instructions there are fetched lane by
+// lane) and forget the shared decodes, which may no longer match what is in memory
+static void ensemble_sync_memory(Chip8Ensemble *e) {
+  memset(e->decoded, 0, sizeof(DecodedInstruction) * e->profile.ram_size);
+  memset(e->written, 0, e->profile.ram_size);
+  for (int lane = 1; lane < e->lanes; lane++) {
+    for (int address = 0; address < e->profile.ram_size; address++) {
+      if (e->machines[lane]->emu_ram[address] != e->machines[0]->emu_ram[address]) {
+        e->written[address] = 1;
+      }
+    }
+  }
+  e->out_of_sync = false;
+}
+
+// the same runs with each machine on its own through the normal engine
+static uint64_t run_ensemble_one_by_one(Chip8Ensemble *e, uint64_t count) {
+  for (int lane = 0; lane < e->lanes; lane++) {
+    run_instructions(e->machines[lane], count);
+  }
+  e->out_of_sync = true; // their stores weren't tracked
+  return count;
+}
+
+static uint64_t run_ensemble_vector(Chip8Ensemble *e, uint64_t count) {
+  if (e->out_of_sync) {
+    ensemble_sync_memory(e);
+  }
+  e->vector_runs++;
+  return e->run(e, count);
+}
+
+#define ENSEMBLE_TRIAL_PERIOD 128 // a trial starts every this many runs
+#define ENSEMBLE_TRIAL_RUNS 4 // a trial times this many runs each way
+
+// run count instructions on every machine in the ensemble. every ENSEMBLE_TRIAL_PERIOD runs the
+// first few go through the vector engine and the next few one machine at a time, each way timed,
+// and the rest until the next trial go whichever way was faster. either way the machines end up
+// in the same place, so this only changes how long it takes
+uint64_t run_ensemble(Chip8Ensemble *e, uint64_t count) {
+  uint64_t phase = e->runs++ % ENSEMBLE_TRIAL_PERIOD;
+  if (phase >= 2 * ENSEMBLE_TRIAL_RUNS) {
+    return e->one_by_one ? run_ensemble_one_by_one(e, count) : run_ensemble_vector(e, count);
+  }
+
+  if (phase == 0) {
+    memset(e->trial_time, 0, sizeof(e->trial_time));
+    memset(e->trial_count, 0, sizeof(e->trial_count));
+  }
+  int way = (phase < ENSEMBLE_TRIAL_RUNS) ? 0 : 1;
+  uint64_t start_time = get_clock_time();
+  if (way == 0) {
+    run_ensemble_vector(e, count);
+  }
+  else {
+    run_ensemble_one_by_one(e, count);
+  }
+  e->trial_time[way] += get_clock_time() - start_time;
+  e->trial_count[way] += count;
+
+  if (phase == 2 * ENSEMBLE_TRIAL_RUNS - 1) {
+    // compare the time per instruction (the runs can be different lengths)
+    e->one_by_one = e->trial_time[1] * e->trial_count[0] < e->trial_time[0] * e->trial_count[1];
+  }
+  return count;
+}
+
+// an ensemble of lanes machines (at most ENSEMBLE_LANES), which must have been created with the same
+// settings. while it exists they should only be run through it, their timers and keys can be
+// changed as usual between runs
+Chip8Ensemble *create_ensemble(Chip8Machine **machines, int lanes) {
+#ifdef _WIN32
+    Chip8Ensemble *e = _aligned_malloc(sizeof(Chip8Ensemble), 64);
+#else
+    Chip8Ensemble *e = aligned_alloc(64, sizeof(Chip8Ensemble));
+#endif // _WIN32
+    memset(e, 0, sizeof(Chip8Ensemble));
+    e->lanes = lanes;
+    memcpy(e->machines, machines, sizeof(Chip8Machine *) * lanes);
+    e->profile = machines[0]->profile;
+    if (e->profile.stack_size > ENSEMBLE_STACK_SIZE) {
+        printf("Ensembles support stacks of up to %d entries\n", ENSEMBLE_STACK_SIZE);
+        exit(1);
+    }
+    e->decoded = calloc(e->profile.ram_size, sizeof(DecodedInstruction));
+
+    // anything already different between the machines (other ROMs, or they have run already) is fetched lane by lane
+    e->written = calloc(e->profile.ram_size, sizeof(uint8_t));
+    ensemble_sync_memory(e);
+
+    e->run = run_ensemble_generic;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+        e->run = run_ensemble_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        e->run = run_ensemble_avx2;
+    }
+#endif // HAVE_X86_SIMD
+    return e;
+}
+
+// free an ensemble (the machines are left alone)
+void destroy_ensemble(Chip8Ensemble *e) {
+    free(e->decoded);
+    free(e->written);
+#ifdef _WIN32
+    _aligned_free(e);
+#else
+    free(e);
+#endif // _WIN32
+}
+
+#endif // __GNUC__
+
+// key down and up on the keypad, the same as the window's key events. a press also answers an
+// FX0A that is waiting for one
+void press_key(Chip8Machine *m, int key) {
+    if (m->keypad_states[key] != 0) {
+        return;
+    }
+    m->keypad_states[key] = 1;
+    if (m->get_key_status == 1) {
+        m->get_key_key = key;
+        m->get_key_status = 2;
+    }
+}
+
+void release_key(Chip8Machine *m, int key) {
+    m->keypad_states[key] = 0;
+}
+
+#define KEY_WAIT_TIMEOUT_MS 1000 // longest a live run sleeps waiting for a key before checking back
+
+// whether the machine can do nothing until a key is pressed: it is waiting in FX0A and both timers
+// have stopped, so one frame is the same as the next
+bool stuck_waiting_for_key(Chip8Machine *m) {
+    return m->get_key_status == 1 && get_delay_timer(m) == 0 && get_sound_timer(m) == 0;
+}
+
+// --keys file: scripted input, so runs without a keyboard (and ROMs waiting on FX0A) still get
+// somewhere. each line is "frame key down|up [machine]" (key as one hex digit), made at the start
+// of that frame. machine picks which copy of an --ensemble the line is for, so each can get its own
+// input; without it the line goes to all of them (a run of one machine is machine 0). the lines
+// must be in frame order, blank lines and ones starting with # are skipped
+typedef struct KeyEvent {
+    uint64_t frame;
+    uint8_t key;
+    bool down;
+    int machine; // -1 for every machine
+} KeyEvent;
+
+KeyEvent *key_events;
+int key_event_count;
+int next_key_event; // the first event that hasn't been made yet
+
+void load_key_script(char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Could not open key script %s\n", path);
+        exit(1);
+    }
+
+    int capacity = 64;
+    key_events = malloc(sizeof(KeyEvent) * capacity);
+    key_event_count = 0;
+    next_key_event = 0;
+
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        unsigned long long frame;
+        unsigned int key;
+        char action[8];
+        int machine = -1;
+        char first = line[strspn(line, " \t")];
+        if (first == '#' || first == '\n' || first == '\r' || first == '\0') {
+            continue;
+        }
+        int fields = sscanf(line, "%llu %x %7s %d", &frame, &key, action, &machine);
+        if (fields < 3 || key > 0xF || (fields == 4 && machine < 0)
+            || (strcmp(action, "down") != 0 && strcmp(action, "up") != 0)) {
+            printf("%s:%d: expected \"frame key down|up [machine]\"\n", path, line_number);
+            exit(1);
+        }
+        if (key_event_count > 0 && frame < key_events[key_event_count - 1].frame) {
+            printf("%s:%d: the frames must not go backwards\n", path, line_number);
+            exit(1);
+        }
+
+        if (key_event_count == capacity) {
+            capacity *= 2;
+            key_events = realloc(key_events, sizeof(KeyEvent) * capacity);
+        }
+        key_events[key_event_count].frame = frame;
+        key_events[key_event_count].key = key;
+        key_events[key_event_count].down = strcmp(action, "down") == 0;
+        key_events[key_event_count].machine = machine;
+        key_event_count++;
+    }
+    fclose(file);
+}
+
+// make the scripted key events due by the start of the given frame on machines 0 to count - 1
+// (lines for machines past those are skipped)
+void apply_key_events_to(Chip8Machine **machines, int count, uint64_t frame) {
+    while (next_key_event < key_event_count && key_events[next_key_event].frame <= frame) {
+        KeyEvent *event = &key_events[next_key_event];
+        for (int i = 0; i < count; i++) {
+            if (event->machine != -1 && event->machine != i) {
+                continue;
+            }
+            if (event->down) {
+                press_key(machines[i], event->key);
+            }
+            else {
+                release_key(machines[i], event->key);
+            }
+        }
+        next_key_event++;
+    }
+}
+
+void apply_key_events(Chip8Machine *m, uint64_t frame) {
+    apply_key_events_to(&m, 1, frame);
+}
+
+#ifdef __GNUC__
+// --ensemble N: run N copies of the ROM without a window for unattended_run_frames(), ENSEMBLE_LANES
+// of them at a time, then print where each one ended up. each copy gets its own random seed (the
+// first one the usual seed) and its own --keys lines, so they play out differently
+void run_ensemble_mode(char *rom) {
+    for (int i = 0; i < key_event_count; i++) {
+        if (key_events[i].machine >= ENSEMBLE_SIZE) {
+            printf("The key script has lines for machine %d, but the ensemble has %d machines\n", key_events[i].machine, ENSEMBLE_SIZE);
+            exit(1);
+        }
+    }
+
+    int groups = (ENSEMBLE_SIZE + ENSEMBLE_LANES - 1) / ENSEMBLE_LANES;
+    Chip8Machine **machines = malloc(sizeof(Chip8Machine *) * ENSEMBLE_SIZE);
+    Chip8Ensemble **ensembles = malloc(sizeof(Chip8Ensemble *) * groups);
+
+    for (int i = 0; i < ENSEMBLE_SIZE; i++) {
+        machines[i] = create_machine();
+        initialize_emu_ram(machines[i]);
+        load_program(machines[i], rom);
+        machines[i]->random_state ^= (uint32_t)i * 0x9E3779B9;
+        if (machines[i]->random_state == 0) {
+            machines[i]->random_state = 1; // xorshift never leaves 0
+        }
+    }
+    for (int g = 0; g < groups; g++) {
+        int lanes = ENSEMBLE_SIZE - g * ENSEMBLE_LANES;
+        ensembles[g] = create_ensemble(&machines[g * ENSEMBLE_LANES], (lanes > ENSEMBLE_LANES) ? ENSEMBLE_LANES : lanes);
+    }
+
+    uint64_t frames = unattended_run_frames();
+    uint64_t start_time = get_clock_time();
+    uint64_t instructions_run = 0;
+    for (uint64_t frame = 0; frame < frames; frame++) {
+        // keys change between runs, when the ensembles have handed everything back to the machines
+        apply_key_events_to(machines, ENSEMBLE_SIZE, frame);
+
+        uint64_t frame_end = instructions_before_frame(frame + 1);
+        for (int g = 0; g < groups; g++) {
+            run_ensemble(ensembles[g], frame_end - instructions_run);
+        }
+        instructions_run = frame_end;
+        for (int i = 0; i < ENSEMBLE_SIZE; i++) {
+            advance_timers(machines[i], 1);
+        }
+    }
+    uint64_t elapsed = get_clock_time() - start_time;
+
+    for (int i = 0; i < ENSEMBLE_SIZE; i++) {
+        printf("%d: ", i);
+        print_machine_state(machines[i]);
+    }
+    uint64_t total = instructions_run * ENSEMBLE_SIZE;
+    printf("Ran %d machines for %llu frames (%llu instructions) in %.3f s, %llu IPS\n", ENSEMBLE_SIZE, (unsigned long long)frames,
+        (unsigned long long)total, (double)elapsed / NSEC_PER_SEC,
+        (unsigned long long)(elapsed > 0 ? total * NSEC_PER_SEC / elapsed : 0));
+    uint64_t runs = 0;
+    uint64_t vector_runs = 0;
+    for (int g = 0; g < groups; g++) {
+        runs += ensembles[g]->runs;
+        vector_runs += ensembles[g]->vector_runs;
+    }
+    printf("%llu%% of the runs went through the vector engine, the rest ran one machine at a time\n",
+        (unsigned long long)(runs > 0 ? vector_runs * 100 / runs : 0));
+
+    for (int g = 0; g < groups; g++) {
+        destroy_ensemble(ensembles[g]);
+    }
+    for (int i = 0; i < ENSEMBLE_SIZE; i++) {
+        destroy_machine(machines[i]);
+    }
+    free(ensembles);
+    free(machines);
+}
+#endif // __GNUC__
+
+// --bench: run the ROM without a window for unattended_run_frames() (or RUN_INSTRUCTIONS
+// instructions) with nothing holding it back, no sleeping, vsync or presents. frames still
+// split the instructions up so the timers and scripted keys come at the usual points. the
+// figures are printed as key=value lines, to compare builds and engines
+void run_bench_mode(char *rom) {
+    Chip8Machine *m = create_machine();
+    initialize_emu_ram(m);
+    load_program(m, rom);
+
+    uint64_t frames = (RUN_INSTRUCTIONS > 0) ? UINT64_MAX : unattended_run_frames();
+    uint64_t instruction_limit = (RUN_INSTRUCTIONS > 0) ? RUN_INSTRUCTIONS : UINT64_MAX;
+
+    uint64_t start_time = get_clock_time();
+    uint64_t frame = 0;
+    uint64_t instructions_run = 0;
+    while (frame < frames && instructions_run < instruction_limit) {
+        apply_key_events(m, frame);
+
+        uint64_t frame_end = instructions_before_frame(frame + 1);
+        uint64_t batch_end = (frame_end < instruction_limit) ? frame_end : instruction_limit;
+        instructions_run += run_instructions(m, batch_end - instructions_run);
+        if (instructions_run < frame_end) {
+            break; // the instruction limit came partway through the frame
+        }
+        frame++;
+        advance_timers(m, 1);
+    }
+    uint64_t elapsed = get_clock_time() - start_time;
+    double seconds = (double)elapsed / NSEC_PER_SEC;
+
+    printf("rom=%s\n", (rom != NULL) ? rom : "(compiled in)");
+    printf("engine=%s\n", engine_names[ENGINE]);
+    printf("frames=%llu\n", (unsigned long long)frame);
+    printf("instructions=%llu\n", (unsigned long long)instructions_run);
+    printf("fused_instructions=%llu\n", (unsigned long long)m->fused_instructions);
+    printf("idle_instructions=%llu\n", (unsigned long long)m->idle_instructions);
+    printf("seconds=%.6f\n", seconds);
+    printf("ips=%llu\n", (unsigned long long)(elapsed > 0 ? instructions_run * NSEC_PER_SEC / elapsed : 0));
+    printf("mips=%.2f\n", (elapsed > 0) ? instructions_run / seconds / 1e6 : 0.0);
+    printf("fps=%.1f\n", (elapsed > 0) ? frame / seconds : 0.0);
+    printf("screen=%016llx\n", (unsigned long long)display_hash(m));
+
+    destroy_machine(m);
+}
+
+// Sound. The beeper sounds while the sound timer is above 0. The emulation loop samples the timer once
+// per frame (see update_beeper()) and passes it on as one flag. With a window an SDL audio
+// callback turns that flag into a square wave, and --wav writes the same wave to a file one frame at a time
+#define AUDIO_SAMPLE_RATE 48000
+#define BEEP_FREQUENCY 480 // divides AUDIO_SAMPLE_RATE, so the wave table is exactly one period long
+#define BEEP_PERIOD (AUDIO_SAMPLE_RATE / BEEP_FREQUENCY)
+#define BEEP_VOLUME 4000 // amplitude of the square wave, out of 32767
+
+int16_t beep_wave[BEEP_PERIOD]; // one period of the square wave, built by initialize_beep_wave()
+
+void initialize_beep_wave() {
+    for (int i = 0; i < BEEP_PERIOD; i++) {
+        beep_wave[i] = (i < BEEP_PERIOD / 2) ? BEEP_VOLUME : -BEEP_VOLUME;
+    }
+}
+
+// count samples of the beeper into out. *phase carries the wave on from the last call so it stays
+// continuous between buffers. silence resets it, so every beep starts the same way
+static void fill_beep(int16_t *out, int count, bool on, int *phase) {
+    if (!on) {
+        memset(out, 0, sizeof(int16_t) * count);
+        *phase = 0;
+        return;
+    }
+    int p = *phase;
+    for (int i = 0; i < count; i++) {
+        out[i] = beep_wave[p];
+        if (++p == BEEP_PERIOD) {
+            p = 0;
+        }
+    }
+    *phase = p;
+}
+
+// --wav file: the beeper as 16 bit mono PCM, AUDIO_SAMPLE_RATE / TIMER_FREQUENCY samples for each
+// emulated frame. nothing in it depends on the host, so a headless run always writes the same file
+FILE *wav_file;
+uint64_t wav_samples; // written so far
+int wav_phase;
+
+static void write_le(FILE *file, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc((value >> (i * 8)) & 0xFF, file);
+    }
+}
+
+// the 44 byte RIFF header. the sizes aren't known until the end, close_wav() writes it again with them
+static void write_wav_header(FILE *file, uint32_t data_bytes) {
+    fwrite("RIFF", 1, 4, file);
+    write_le(file, 36 + data_bytes, 4);
+    fwrite("WAVEfmt ", 1, 8, file);
+    write_le(file, 16, 4); // fmt chunk size
+    write_le(file, 1, 2); // PCM
+    write_le(file, 1, 2); // mono
+    write_le(file, AUDIO_SAMPLE_RATE, 4);
+    write_le(file, AUDIO_SAMPLE_RATE * sizeof(int16_t), 4); // bytes per second
+    write_le(file, sizeof(int16_t), 2); // bytes per sample
+    write_le(file, 16, 2); // bits per sample
+    fwrite("data", 1, 4, file);
+    write_le(file, data_bytes, 4);
+}
+
+void open_wav(char *path) {
+    wav_file = fopen(path, "wb");
+    if (wav_file == NULL) {
+        printf("Could not open %s for writing\n", path);
+        exit(1);
+    }
+    wav_samples = 0;
+    wav_phase = 0;
+    write_wav_header(wav_file, 0);
+}
+
+// the samples for one frame, frame counting from 0
+static void write_wav_frame(bool on, uint64_t frame) {
+    uint64_t frame_end = (frame + 1) * AUDIO_SAMPLE_RATE / (uint64_t)TIMER_FREQUENCY;
+    int16_t samples[512];
+    while (wav_samples < frame_end) {
+        int count = (frame_end - wav_samples < 512) ? (int)(frame_end - wav_samples) : 512;
+        fill_beep(samples, count, on, &wav_phase);
+        for (int i = 0; i < count; i++) {
+            write_le(wav_file, (uint16_t)samples[i], 2);
+        }
+        wav_samples += count;
+    }
+}
+
+void close_wav() {
+    fseek(wav_file, 0, SEEK_SET);
+    write_wav_header(wav_file, (uint32_t)(wav_samples * sizeof(int16_t)));
+    fclose(wav_file);
+    wav_file = NULL;
+}
+
+#ifndef HEADLESS
+// The audio callback runs on SDL's audio thread and must never wait, so the only thing it shares
+// with the emulation thread is beeper_on (plus when that last changed, for the latency figure).
+// The device buffer is kept small (AUDIO_BUFFER_SAMPLES, --audio-buffer), so a change is heard
+// within a few milliseconds. The callback also counts what the per second stats report about it
+SDL_AudioDeviceID audio_device; // 0 when there is no sound
+int audio_buffer_samples; // the device's buffer, which may not be what was asked for
+atomic_bool beeper_on;
+atomic_ullong beeper_changed_time; // get_clock_time() when the emulation thread last changed beeper_on
+
+atomic_int audio_callbacks; // since the stats were last printed
+atomic_int audio_underruns; // callbacks that came so late the device must have run dry
+atomic_ullong audio_latency_total; // nanoseconds from a beeper change to it reaching the speaker, summed
+atomic_int audio_latency_count;
+atomic_ullong audio_latency_max;
+
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    static int phase;
+    static bool playing;
+    static uint64_t last_callback_time;
+    (void)userdata;
+
+    uint64_t now = get_clock_time();
+    uint64_t buffer_time = (uint64_t)audio_buffer_samples * NSEC_PER_SEC / AUDIO_SAMPLE_RATE;
+    if (last_callback_time != 0 && now - last_callback_time > buffer_time + buffer_time / 2) {
+        atomic_fetch_add_explicit(&audio_underruns, 1, memory_order_relaxed);
+    }
+    last_callback_time = now;
+    atomic_fetch_add_explicit(&audio_callbacks, 1, memory_order_relaxed);
+
+    bool on = atomic_load_explicit(&beeper_on, memory_order_acquire);
+    if (on != playing) {
+        // what is written now plays once the buffer ahead of it has, about one buffer from now
+        uint64_t changed_time = atomic_load_explicit(&beeper_changed_time, memory_order_relaxed);
+        uint64_t latency = (now > changed_time ? now - changed_time : 0) + buffer_time;
+        atomic_fetch_add_explicit(&audio_latency_total, latency, memory_order_relaxed);
+        atomic_fetch_add_explicit(&audio_latency_count, 1, memory_order_relaxed);
+        if (latency > atomic_load_explicit(&audio_latency_max, memory_order_relaxed)) {
+            atomic_store_explicit(&audio_latency_max, latency, memory_order_relaxed);
+        }
+        playing = on;
+    }
+
+    fill_beep((int16_t *)stream, len / (int)sizeof(int16_t), on, &phase);
+}
+
+// opens the default output device and starts the callback. without one the emulator carries on silently
+void open_audio() {
+    SDL_AudioSpec want, have;
+    SDL_zero(want);
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_BUFFER_SAMPLES;
+    want.callback = audio_callback;
+
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if (audio_device == 0) {
+        printf("No sound: %s\n", SDL_GetError());
+        return;
+    }
+    audio_buffer_samples = have.samples;
+    printf("Audio: %d Hz, %d sample buffer (%.1f ms)\n", have.freq, have.samples, have.samples * 1000.0 / have.freq);
+    SDL_PauseAudioDevice(audio_device, 0);
+}
+
+void close_audio() {
+    if (audio_device != 0) {
+        SDL_CloseAudioDevice(audio_device);
+        audio_device = 0;
+    }
+}
+
+// the callback's figures since the last call, for the per second stats
+void print_audio_stats() {
+    int count = atomic_exchange(&audio_latency_count, 0);
+    uint64_t total = atomic_exchange(&audio_latency_total, 0);
+    uint64_t max = atomic_exchange(&audio_latency_max, 0);
+    printf("Audio: %d callbacks, %d underruns", atomic_exchange(&audio_callbacks, 0), atomic_exchange(&audio_underruns, 0));
+    if (count > 0) {
+        printf(", latency %.1f ms (max %.1f ms)", (double)total / count / 1000000.0, (double)max / 1000000.0);
+    }
+    printf("\n");
+}
+#endif // HEADLESS
+
+// called by the emulation loop after running each frame's batch, before the timers tick, so a
+// sound timer of 1 still sounds for one frame
+void update_beeper(Chip8Machine *m, uint64_t frame) {
+    bool on = get_sound_timer(m) > 0;
+#ifndef HEADLESS
+    if (on != atomic_load_explicit(&beeper_on, memory_order_relaxed)) {
+        atomic_store_explicit(&beeper_changed_time, get_clock_time(), memory_order_relaxed);
+        atomic_store_explicit(&beeper_on, on, memory_order_release);
+    }
+#endif // HEADLESS
+    if (wav_file != NULL) {
+        write_wav_frame(on, frame);
+    }
+}
+
+// --governor: IPS is tuned to each ROM while it runs. Most ROMs keep their pace by waiting for the
+// delay timer once a frame's work is done, and those waits show up as timer polls (FX07) and time
+// in idle loops. A ROM whose frames all finish with time left over gets less IPS, down to what its
+// busiest frame needs plus a margin. One where some frames never get to their wait is running slow
+// and gets more. ROMs that never wait for the timer take their pace from IPS itself, so they are left
+// alone, and frames spent waiting in FX0A are left out as they say nothing about the game. Changes
+// are made once every emulated second, within GOVERNOR_MIN_IPS and GOVERNOR_MAX_IPS, and the IPS
+// a ROM ends up on is saved under a hash of the ROM in GOVERNOR_FILE, where the next run starts from.
+#define GOVERNOR_FILE "chip8_ips.txt"
+#define GOVERNOR_MARGIN 4 // the busiest frame plus 1/GOVERNOR_MARGIN of it again
+
+typedef struct IpsGovernor {
+    uint64_t frames; // counted in this window (frames waiting in FX0A aren't)
+    uint64_t waited_frames; // frames that finished early and waited for the timer
+    uint64_t unmeasured_frames; // waited frames whose wait loop wasn't one skip_idle_loop() knows, so how busy they were is unknown
+    uint64_t peak_busy; // most instructions a measured frame ran before it started waiting
+    uint64_t draws; // sprites drawn in this window
+    int floor; // lowest IPS frames have not overrun at, the governor doesn't go back below it (0 if none yet)
+
+    // the machine's counters at the start of the frame
+    uint64_t timer_polls;
+    uint64_t idle_instructions;
+    uint64_t draw_count;
+} IpsGovernor;
+
+uint64_t governor_rom_hash; // what the ROM is saved under in GOVERNOR_FILE
+
+// FNV-1a hash of the program as loaded, everything from PROGRAM_START_BYTE up
+uint64_t program_hash(Chip8Machine *m) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int address = PROGRAM_START_BYTE; address < RAM_SIZE; address++) {
+        hash = (hash ^ m->emu_ram[address]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// the IPS saved for a ROM, 0 if there isn't one
+int load_governor_ips(uint64_t hash) {
+    FILE *file = fopen(GOVERNOR_FILE, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    int ips = 0;
+    unsigned long long line_hash;
+    int line_ips;
+    while (fscanf(file, "%llx %d", &line_hash, &line_ips) == 2) {
+        if (line_hash == hash) {
+            ips = line_ips;
+        }
+    }
+    fclose(file);
+    return ips;
+}
+
+// save the IPS for a ROM, replacing the one it had before
+void save_governor_ips(uint64_t hash, int ips) {
+    int capacity = 64;
+    int count = 0;
+    unsigned long long *hashes = malloc(sizeof(unsigned long long) * capacity);
+    int *values = malloc(sizeof(int) * capacity);
+
+    FILE *file = fopen(GOVERNOR_FILE, "r");
+    if (file != NULL) {
+        unsigned long long line_hash;
+        int line_ips;
+        while (fscanf(file, "%llx %d", &line_hash, &line_ips) == 2) {
+            if (line_hash == hash) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                hashes = realloc(hashes, sizeof(unsigned long long) * capacity);
+                values = realloc(values, sizeof(int) * capacity);
+            }
+            hashes[count] = line_hash;
+            values[count] = line_ips;
+            count++;
+        }
+        fclose(file);
+    }
+
+    file = fopen(GOVERNOR_FILE, "w");
+    if (file == NULL) {
+        printf("Could not save the IPS to %s\n", GOVERNOR_FILE);
+    }
+    else {
+        for (int i = 0; i < count; i++) {
+            fprintf(file, "%016llx %d\n", hashes[i], values[i]);
+        }
+        fprintf(file, "%016llx %d\n", (unsigned long long)hash, ips);
+        fclose(file);
+    }
+    free(hashes);
+    free(values);
+}
+
+static int clamp_ips(int ips) {
+    if (ips < GOVERNOR_MIN_IPS) {
+        return GOVERNOR_MIN_IPS;
+    }
+    if (ips > GOVERNOR_MAX_IPS) {
+        return GOVERNOR_MAX_IPS;
+    }
+    return ips;
+}
+
+void start_governor(IpsGovernor *g, Chip8Machine *m) {
+    memset(g, 0, sizeof(IpsGovernor));
+    g->timer_polls = m->timer_polls;
+    g->idle_instructions = m->idle_instructions;
+    g->draw_count = m->draw_count;
+}
+
+// called after each frame's batch (ran instructions, the frame that was run). once a window is
+// full it picks the IPS for the frames after it
+void govern_ips(IpsGovernor *g, Chip8Machine *m, uint64_t ran, uint64_t frame) {
+    uint64_t polls = m->timer_polls - g->timer_polls;
+    uint64_t idle = m->idle_instructions - g->idle_instructions;
+    uint64_t draws = m->draw_count - g->draw_count;
+    g->timer_polls = m->timer_polls;
+    g->idle_instructions = m->idle_instructions;
+    g->draw_count = m->draw_count;
+
+    if (m->get_key_status == 1) {
+        return; // waiting for a key
+    }
+    g->frames++;
+    g->draws += draws;
+    if (idle > 0) {
+        g->waited_frames++;
+        if (ran - idle > g->peak_busy) {
+            g->peak_busy = ran - idle;
+        }
+    }
+    else if (polls >= 2) {
+        // polled the timer over and over, in a loop skip_idle_loop() doesn't know
+        g->waited_frames++;
+        g->unmeasured_frames++;
+    }
+    if (g->frames < (uint64_t)TIMER_FREQUENCY) {
+        return;
+    }
+
+    int ips = IPS;
+    uint64_t overruns = g->frames - g->waited_frames;
+    if (g->waited_frames == 0) {
+        // paced by IPS, not the timer
+    }
+    else if (overruns > 0) {
+        // well behind when most frames overran, a quarter up when only a few did
+        g->floor = (overruns * 2 > g->frames) ? IPS * 2 : IPS + IPS / 4;
+        ips = g->floor;
+    }
+    else {
+        int target = IPS - IPS / 8; // without a measurement, step down and see whether frames start overrunning
+        if (g->unmeasured_frames == 0) {
+            target = (int)((g->peak_busy + g->peak_busy / GOVERNOR_MARGIN) * TIMER_FREQUENCY);
+        }
+        if (target < IPS - IPS / 4) {
+            target = IPS - IPS / 4; // at most a quarter down at a time
+        }
+        if (target < g->floor) {
+            target = g->floor;
+        }
+        if (target < IPS) {
+            ips = target;
+        }
+    }
+    ips = clamp_ips(ips);
+
+    if (ips != IPS) {
+        printf("Governor: %d IPS (was %d, %llu of %llu frames overran, busiest %llu instructions, %.1f draws per frame)\n",
+            ips, IPS, (unsigned long long)overruns, (unsigned long long)g->frames, (unsigned long long)g->peak_busy,
+            (double)g->draws / g->frames);
+        set_ips(ips, frame + 1);
+    }
+
+    int floor = g->floor;
+    start_governor(g, m);
+    g->floor = floor;
+}
+
+#ifndef HEADLESS
+// Threads. With a window the emulator runs on two threads. The main thread handles SDL's events
+// and draws, and the emulation thread runs the machine's frames on its own clock. Neither ever
+// waits on the other: finished screens go to the main thread through a triple buffer, and key
+// presses come the other way through a single producer, single consumer queue, so a present held
+// up by vsync or the compositor never holds up emulated time (or the other way round).
+
+// Triple buffer. The emulation thread fills its back slot and publishes it by swapping it with the
+// middle one, the main thread takes the newest screen by swapping the middle slot with its front
+// one. Each swap is one atomic exchange, and outside of those each thread only touches its own slot.
+#define SLOT_FRESH 4 // set in middle_slot while it holds a screen the main thread hasn't taken yet
+
+typedef struct ScreenSlot {
+    uint64_t rows[64]; // display_rows (SCREEN_HEIGHT is at most 64)
+} ScreenSlot;
+
+ScreenSlot screen_slots[3];
+int back_slot = 0; // the emulation thread's
+atomic_int middle_slot = 1;
+int front_slot = 2; // the main thread's
+
+// Key queue. The main thread pushes key_queue_tail on, the emulation thread pulls key_queue_head
+// up to it. Each entry is a key, with KEY_QUEUE_DOWN set for a press.
+#define KEY_QUEUE_SIZE 256 // must be a power of two
+#define KEY_QUEUE_DOWN 0x10
+
+uint8_t key_queue[KEY_QUEUE_SIZE];
+atomic_uint key_queue_head;
+atomic_uint key_queue_tail;
+SDL_sem *key_signal; // the emulation thread sleeps on this while waiting for a key (see wait_for_queued_key())
+atomic_bool key_waiting; // it is about to sleep or asleep there, so the next push should post
+
+atomic_bool fast_forward; // TAB is held down, the emulation thread runs at FAST_FORWARD_SPEED
+atomic_int screens_skipped; // screens replaced before the main thread took them, since the stats were last printed
+atomic_bool emulation_quit; // set by the main thread to stop the emulation thread
+atomic_bool emulation_finished; // set by the emulation thread when it stops by itself (--frames ran out)
+atomic_int present_count; // presents since the emulation thread last printed the stats
+Uint32 wake_event_type; // the SDL event the emulation thread sends to wake the main thread
+atomic_bool wake_pending; // one of those is already on its way
+
+// wake the main thread, unless it is already being woken
+static void wake_main_thread() {
+    if (!atomic_exchange(&wake_pending, true)) {
+        SDL_Event event;
+        memset(&event, 0, sizeof(event));
+        event.type = wake_event_type;
+        SDL_PushEvent(&event);
+    }
+}
+
+// emulation thread: hand the machine's screen over to be drawn. when the emulation runs ahead of
+// the presents (fast forward, a slow host) the screen before it may not have been taken yet, it is
+// dropped, which is all frame skipping takes
+void publish_screen(Chip8Machine *m) {
+    memcpy(screen_slots[back_slot].rows, m->display_rows, sizeof(uint64_t) * SCREEN_HEIGHT);
+    int old_slot = atomic_exchange(&middle_slot, back_slot | SLOT_FRESH);
+    if (old_slot & SLOT_FRESH) {
+        atomic_fetch_add_explicit(&screens_skipped, 1, memory_order_relaxed);
+    }
+    back_slot = old_slot & ~SLOT_FRESH;
+    m->dirty_rows = 0;
+    wake_main_thread();
+}
+
+// main thread: the newest screen, or NULL if there hasn't been a new one since the last call
+ScreenSlot *take_screen() {
+    if ((atomic_load(&middle_slot) & SLOT_FRESH) == 0) {
+        return NULL;
+    }
+    front_slot = atomic_exchange(&middle_slot, front_slot) & ~SLOT_FRESH;
+    return &screen_slots[front_slot];
+}
+
+// main thread: pass a key press or release on to the emulation thread
+void queue_key(int key, bool down) {
+    unsigned int tail = atomic_load_explicit(&key_queue_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&key_queue_head, memory_order_acquire) == KEY_QUEUE_SIZE) {
+        printf("Key queue full, dropped a key\n");
+        return;
+    }
+    key_queue[tail & (KEY_QUEUE_SIZE - 1)] = key | (down ? KEY_QUEUE_DOWN : 0);
+    atomic_store_explicit(&key_queue_tail, tail + 1, memory_order_release);
+    if (atomic_exchange(&key_waiting, false)) {
+        SDL_SemPost(key_signal);
+    }
+}
+
+// emulation thread: make the key presses and releases queued since the last call
+void take_queued_keys(Chip8Machine *m) {
+    unsigned int head = atomic_load_explicit(&key_queue_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&key_queue_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        uint8_t entry = key_queue[head & (KEY_QUEUE_SIZE - 1)];
+        if (entry & KEY_QUEUE_DOWN) {
+            press_key(m, entry & 0xF);
+        }
+        else {
+            release_key(m, entry & 0xF);
+        }
+    }
+    atomic_store_explicit(&key_queue_head, head, memory_order_release);
+}
+
+static bool key_queue_empty() {
+    return atomic_load(&key_queue_head) == atomic_load(&key_queue_tail);
+}
+
+// emulation thread: sleep until a key is queued, the main thread wants it to stop, or the timeout.
+// queue_key() only posts while key_waiting is set, so posts don't pile up over a session of key
+// presses and come back later as wakeups with nothing behind them. the one left over when a key
+// arrives just as the wait ends is cleared out before the next wait
+void wait_for_queued_key() {
+    while (SDL_SemTryWait(key_signal) == 0) {
+    }
+    atomic_store(&key_waiting, true);
+    if (key_queue_empty() && !atomic_load(&emulation_quit)) {
+        SDL_SemWaitTimeout(key_signal, KEY_WAIT_TIMEOUT_MS);
+    }
+    atomic_store(&key_waiting, false);
+}
+#endif // HEADLESS
+
+// Runs the machine frame by frame until the main thread says to stop (or --frames runs out). the
+// emulator runs in frames of 1/TIMER_FREQUENCY seconds: each frame runs its share of instructions
+// in one batch, ticks the timers, then sleeps until the next frame deadline. with a window this is
+// the emulation thread, headless builds run it on the main thread
+int run_emulation(void *data) {
+    Chip8Machine *machine = data;
+
+    uint64_t start_time = get_frame_clock(); // clock time of the start of frame 0
+    double speed = SPEED; // what the frame times are scaled by (see scaled_frame_time())
+    uint64_t frame = 0; // the frame about to run
+    uint64_t instructions_run = 0; // instructions run since frame 0
+#ifdef HEADLESS
+    uint64_t frame_limit = unattended_run_frames(); // nobody can close the window, so stop after this many frames
+    uint64_t host_start_time = get_clock_time();
+#else
+    uint64_t frame_limit = RUN_FRAMES; // 0 runs until the window is closed
+
+    uint64_t ips_counter_last = start_time;
+    uint64_t ips_counter_instructions = 0;
+    uint64_t fused_counter_instructions = 0;
+    uint64_t idle_counter_instructions = 0;
+    int timer_count = 0;
+
+    publish_screen(machine); // the first present uploads everything
+#endif // HEADLESS
+
+    IpsGovernor governor;
+    start_governor(&governor, machine);
+
+    while (true) {
+#ifndef HEADLESS
+        if (atomic_load(&emulation_quit)) {
+            break;
+        }
+        take_queued_keys(machine);
+#endif // HEADLESS
+        apply_key_events(machine, frame);
+
+        // run this frame's batch of instructions
+        uint64_t frame_end = instructions_before_frame(frame + 1);
+        uint64_t ran = run_instructions(machine, frame_end - instructions_run);
+        instructions_run += ran;
+        update_beeper(machine, frame);
+        if (GOVERNOR == 1) {
+            govern_ips(&governor, machine, ran, frame);
+        }
+        frame++;
+
+        advance_timers(machine, 1);
+
+        // draw/clear instructions only mark the screen dirty, so however many sprites a frame
+        // draws there is at most one new screen per frame (and none at all when no rows have changed)
+        if (machine->dirty_rows != 0) {
+#ifdef HEADLESS
+            draw_frame(machine);
+#else
+            publish_screen(machine);
+#endif // HEADLESS
+        }
+        if (frame == frame_limit) {
+            break;
+        }
+
+        uint64_t now = get_frame_clock();
+
+#ifndef HEADLESS
+        timer_count++;
+        if (now - ips_counter_last >= NSEC_PER_SEC) {
+            // scale to the exact window length so the figure isn't skewed by when the check ran
+            uint64_t window = now - ips_counter_last;
+            printf("IPS: %llu\n", (unsigned long long)((instructions_run - ips_counter_instructions) * NSEC_PER_SEC / window));
+
+            // how much of that ran as superinstructions
+            uint64_t fused = machine->fused_instructions - fused_counter_instructions;
+            uint64_t instructions = instructions_run - ips_counter_instructions;
+            printf("Fused: %llu per frame (%llu%%)\n", (unsigned long long)(timer_count > 0 ? fused / timer_count : 0),
+                (unsigned long long)(instructions > 0 ? fused * 100 / instructions : 0));
+            fused_counter_instructions = machine->fused_instructions;
+
+            // and how much was passed over waiting in idle loops
+            uint64_t idle = machine->idle_instructions - idle_counter_instructions;
+            printf("Idle: %llu%%\n", (unsigned long long)(instructions > 0 ? idle * 100 / instructions : 0));
+            idle_counter_instructions = machine->idle_instructions;
+
+            ips_counter_last = now;
+            ips_counter_instructions = instructions_run;
+
+            printf("Timer: %d\n", timer_count);
+            printf("Speed: %.2fx\n", (double)timer_count * NSEC_PER_SEC / window / TIMER_FREQUENCY); // the speed actually achieved
+            timer_count = 0;
+
+            printf("FPS: %d (%d screens skipped)\n", atomic_exchange(&present_count, 0), atomic_exchange(&screens_skipped, 0));
+            if (audio_device != 0) {
+                print_audio_stats();
+            }
+        }
+
+        if (stuck_waiting_for_key(machine) && next_key_event == key_event_count) {
+            // rather than waking up for frames where nothing happens, sleep until the main thread queues a
+            // key (headless runs have nothing to wait for, their frames cost next to nothing). the frames
+            // spent waiting are left out, the same as after falling behind
+            wait_for_queued_key();
+            start_time = get_frame_clock() - scaled_frame_time(frame, speed);
+            continue;
+        }
+#endif // HEADLESS
+
+#ifndef HEADLESS
+        double new_speed = atomic_load(&fast_forward) ? FAST_FORWARD_SPEED : SPEED;
+#else
+        double new_speed = SPEED;
+#endif // HEADLESS
+        if (new_speed != speed) {
+            // from here on frames come at the new speed, starting with the next one straight away
+            speed = new_speed;
+            start_time = now - scaled_frame_time(frame, speed);
+        }
+        if (speed == 0) {
+            continue; // no limit, on to the next frame
+        }
+
+        // sleep until the start of the next frame. the deadline is absolute so time spent
+        // running the batch does not push later frames back
+        uint64_t frame_deadline = start_time + scaled_frame_time(frame, speed);
+
+        if (now > frame_deadline + NSEC_PER_SEC / 4) {
+            // more than a quarter second behind (window dragged, machine suspended, a speed the host
+            // can't keep up with), don't try to catch up. moving the start time keeps the frame and
+            // instruction counts consistent
+            start_time = now - scaled_frame_time(frame, speed);
+            frame_deadline = now;
+        }
+
+        wait_for_frame(frame_deadline);
+    }
+
+    if (GOVERNOR == 1) {
+        save_governor_ips(governor_rom_hash, IPS);
+        printf("Governor: saved %d IPS for this ROM in %s\n", IPS, GOVERNOR_FILE);
+    }
+
+#ifdef HEADLESS
+    // the per second figures would come every emulated second, so there is one summary at the end instead
+    uint64_t elapsed = get_clock_time() - host_start_time;
+    print_machine_state(machine);
+    printf("Ran %llu frames (%llu instructions) in %.3f s, %llu IPS\n", (unsigned long long)frame,
+        (unsigned long long)instructions_run, (double)elapsed / NSEC_PER_SEC,
+        (unsigned long long)(elapsed > 0 ? instructions_run * NSEC_PER_SEC / elapsed : 0));
+    // key=value like --bench, so corpus runs can pick the fusion and idle figures out
+    printf("fused_instructions=%llu idle_instructions=%llu\n", (unsigned long long)machine->fused_instructions,
+        (unsigned long long)machine->idle_instructions);
+#else
+    atomic_store(&emulation_finished, true);
+    wake_main_thread();
+#endif // HEADLESS
+    return 0;
+}
+
+#ifndef HEADLESS
+// the keyboard keys for the chip8 keys 0 to F (the 4x4 block from 1 to V on a QWERTY keyboard)
+static const SDL_Scancode keypad_scancodes[16] = {
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V,
+};
+
+// deal with one SDL event on the main thread. returns false once the window has been closed
+bool handle_event(SDL_Event *e) {
+    switch (e->type) {
+        case SDL_QUIT:
+            return false;
+        case SDL_WINDOWEVENT:
+            if (e->window.event == SDL_WINDOWEVENT_EXPOSED) {
+                redraw_requested = true;
+            }
+            break;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            if (e->key.repeat) {
+                break; // held down, not pressed again
+            }
+            if (e->key.keysym.scancode == SDL_SCANCODE_TAB) {
+                atomic_store(&fast_forward, e->type == SDL_KEYDOWN);
+                break;
+            }
+            for (int key = 0; key < 16; key++) {
+                if (e->key.keysym.scancode == keypad_scancodes[key]) {
+                    queue_key(key, e->type == SDL_KEYDOWN);
+                }
+            }
+            break;
+        default:
+            if (e->type == wake_event_type) {
+                atomic_store(&wake_pending, false);
+            }
+            break;
+    }
+    return true;
+}
+
+// the main thread while the window is open: start the emulation thread, then sleep until an event
+// comes in (the emulation thread sends one with each new screen), deal with it and present whatever
+// changed, no more often than the display refreshes
+void run_window(Chip8Machine *machine) {
+    key_signal = SDL_CreateSemaphore(0);
+    wake_event_type = SDL_RegisterEvents(1);
+    open_audio();
+    SDL_Thread *emulation_thread = SDL_CreateThread(run_emulation, "emulation", machine);
+    if (key_signal == NULL || wake_event_type == (Uint32)-1 || emulation_thread == NULL) {
+        printf("Could not start the emulation thread: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    uint64_t shown_rows[64] = {0}; // the screen as the texture has it
+    uint64_t changed_rows = ~(uint64_t)0; // rows that differ from the last present, the first one uploads everything
+    uint64_t next_present_time = get_clock_time(); // the earliest time the screen can next be drawn
+
+    bool quit = false;
+    while (!quit) {
+        // sleep until the next event, or until the next present can go out if one is waiting
+        int timeout = KEY_WAIT_TIMEOUT_MS;
+        uint64_t now = get_clock_time();
+        if (changed_rows != 0 || redraw_requested) {
+            timeout = (next_present_time > now) ? (int)((next_present_time - now + 999999) / 1000000) : 0;
+        }
+        SDL_Event e;
+        if (SDL_WaitEventTimeout(&e, timeout)) {
+            do {
+                if (!handle_event(&e)) {
+                    quit = true;
+                }
+            } while (SDL_PollEvent(&e));
+        }
+
+        ScreenSlot *screen = take_screen();
+        if (screen != NULL) {
+            for (int y = 0; y < SCREEN_HEIGHT; y++) {
+                if (screen->rows[y] != shown_rows[y]) {
+                    changed_rows |= (uint64_t)1 << y;
+                    shown_rows[y] = screen->rows[y];
+                }
+            }
+        }
+
+        now = get_clock_time();
+        // an unchanged screen is never presented again, UNHOOK_FPS only sets how often it can be
+        bool present_due = changed_rows != 0 || redraw_requested;
+        if (present_due && now >= next_present_time) {
+            present_screen(shown_rows, changed_rows);
+            changed_rows = 0;
+            redraw_requested = false;
+            atomic_fetch_add(&present_count, 1);
+
+            next_present_time += (UNHOOK_FPS == 1) ? NSEC_PER_SEC / FPS : present_interval;
+            if (next_present_time < now) {
+                next_present_time = now;
+            }
+        }
+
+        if (atomic_load(&emulation_finished)) {
+            quit = true;
+        }
+    }
+
+    atomic_store(&emulation_quit, true);
+    SDL_SemPost(key_signal); // in case it is asleep waiting for a key (emulation_quit is set first, so it can't miss this)
+    SDL_WaitThread(emulation_thread, NULL);
+    SDL_DestroySemaphore(key_signal);
+    close_audio();
+}
+#endif // HEADLESS
+
+// int gettimeofday(struct timespec * tp)
+// {
+//     // Note: some broken versions only have 8 trailing zero's, the correct epoch has 9 trailing zero's
+//     // This magic number is the number of 100 nanosecond intervals since January 1, 1601 (UTC)
+//     // until 00:00:00 January 1, 1970 
+//     static const uint64_t EPOCH = ((uint64_t) 116444736000000000ULL);
+
+//     SYSTEMTIME  system_time;
+//     FILETIME    file_time;
+//     uint64_t    time;
+
+//     GetSystemTime( &system_time );
+//     SystemTimeToFileTime( &system_time, &file_time );
 //     time =  ((uint64_t)file_time.dwLowDateTime )      ;
 //     time += ((uint64_t)file_time.dwHighDateTime) << 32;
 
@@ -891,15 +4136,165 @@ void get_clock_time(struct timespec *ts) {
 // }
 
 void parse_args(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Please specify a rom file\n");
+    rom_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) {
+                ENGINE = ENGINE_SWITCH;
+            }
+            else if (strcmp(argv[i], "threaded") == 0) {
+#ifdef __GNUC__
+                ENGINE = ENGINE_THREADED;
+#else
+                printf("The threaded engine needs GCC or Clang, using switch\n");
+#endif // __GNUC__
+            }
+            else if (strcmp(argv[i], "dynarec") == 0) {
+#ifdef HAVE_DYNAREC
+                ENGINE = ENGINE_DYNAREC;
+#else
+                printf("The dynarec engine needs an x86-64 GCC or Clang build, using switch\n");
+#endif // HAVE_DYNAREC
+            }
+            else if (strcmp(argv[i], "aot") == 0) {
+#ifdef AOT_SOURCE
+                ENGINE = ENGINE_AOT;
+#else
+                printf("The aot engine needs a build with -DAOT_SOURCE, using switch\n");
+#endif // AOT_SOURCE
+            }
+            else {
+                printf("Unknown engine %s (use switch, threaded, dynarec or aot)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            i++;
+            const NamedProfile *named = NULL;
+            for (int p = 0; p < NAMED_PROFILE_COUNT; p++) {
+                if (strcmp(argv[i], named_profiles[p].name) == 0) {
+                    named = &named_profiles[p];
+                }
+            }
+            if (named == NULL) {
+                printf("Unknown profile %s (use default, vip, chip48, schip or xochip)\n", argv[i]);
+                exit(1);
+            }
+            COPY_SHIFT = named->profile->copy_shift;
+            JUMP_OFFSET_MODE = named->profile->jump_offset_mode;
+            LOAD_STORE_MODE = named->profile->load_store_mode;
+            SPRITE_WRAP = named->profile->sprite_wrap;
+        }
+        else if (strcmp(argv[i], "--aot-emit") == 0 && i + 1 < argc) {
+            i++;
+            aot_output_path = argv[i];
+        }
+        else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc) {
+            i++;
+#ifdef __GNUC__
+            ENSEMBLE_SIZE = atoi(argv[i]);
+            if (ENSEMBLE_SIZE < 1) {
+                printf("The ensemble needs at least one machine\n");
+                exit(1);
+            }
+#else
+            printf("Ensembles need GCC or Clang, running one machine\n");
+#endif // __GNUC__
+        }
+        else if (strcmp(argv[i], "--bench") == 0) {
+            BENCH_MODE = 1;
+        }
+        else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc) {
+            i++;
+            RUN_INSTRUCTIONS = strtoull(argv[i], NULL, 10);
+            if (RUN_INSTRUCTIONS < 1) {
+                printf("The run needs at least one instruction\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            i++;
+            key_script_path = argv[i];
+        }
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            i++;
+            IPS = atoi(argv[i]);
+            if (IPS < 1) {
+                printf("IPS must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if ((strcmp(argv[i], "--speed") == 0 || strcmp(argv[i], "--fast-forward") == 0) && i + 1 < argc) {
+            double *speed = (strcmp(argv[i], "--speed") == 0) ? &SPEED : &FAST_FORWARD_SPEED;
+            i++;
+            if (strcmp(argv[i], "max") == 0) {
+                *speed = 0;
+            }
+            else {
+                *speed = atof(argv[i]);
+                if (*speed <= 0) {
+                    printf("The speed must be above 0 (or max)\n");
+                    exit(1);
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--governor") == 0) {
+            GOVERNOR = 1;
+        }
+        else if (strcmp(argv[i], "--ips-range") == 0 && i + 2 < argc) {
+            GOVERNOR_MIN_IPS = atoi(argv[i + 1]);
+            GOVERNOR_MAX_IPS = atoi(argv[i + 2]);
+            i += 2;
+            if (GOVERNOR_MIN_IPS < 1 || GOVERNOR_MAX_IPS < GOVERNOR_MIN_IPS) {
+                printf("The IPS range needs 1 <= min <= max\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc) {
+            i++;
+            wav_path = argv[i];
+        }
+        else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc) {
+            i++;
+            AUDIO_BUFFER_SAMPLES = atoi(argv[i]);
+            if (AUDIO_BUFFER_SAMPLES < 16 || AUDIO_BUFFER_SAMPLES > 8192) {
+                printf("The audio buffer must be between 16 and 8192 samples\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            i++;
+            RUN_FRAMES = atoi(argv[i]);
+            if (RUN_FRAMES < 1) {
+                printf("The run needs at least one frame\n");
+                exit(1);
+            }
+        }
+        else if (rom_path == NULL) {
+            rom_path = malloc(sizeof(char) * (strlen(argv[i]) + 1));
+            strcpy(rom_path, argv[i]);
+        }
+    }
+
+    // those runs don't go through the frame loop that writes the beeper out
+    if (wav_path != NULL && (BENCH_MODE == 1 || ENSEMBLE_SIZE > 0)) {
+        printf("--wav can't be used with %s\n", (ENSEMBLE_SIZE > 0) ? "--ensemble" : "--bench");
         exit(1);
     }
-    else {
-        rom_path = malloc(sizeof(char) * (strlen(argv[1]) + 1));
-        strcpy(rom_path, argv[1]);
-        printf("%s\n", rom_path);
+
+    if (rom_path != NULL && BENCH_MODE == 0) {
+        printf("%s\n", rom_path); // kept out of --bench output, which should be nothing but its figures
+    }
+
+#ifndef AOT_SOURCE
+    // builds with a compiled in ROM run that when no rom file is given
+    if (rom_path == NULL) {
+        printf("Please specify a rom file\n");
+        exit(1);
     }
+#endif // AOT_SOURCE
 }
  
 int main(int argc, char *argv[])
@@ -908,6 +4303,37 @@ int main(int argc, char *argv[])
 
     parse_args(argc, argv);
 
+    if (aot_output_path != NULL) {
+        if (rom_path == NULL) {
+            printf("Please specify the rom file to compile\n");
+            return EXIT_FAILURE;
+        }
+        Chip8Machine *machine = create_machine();
+        initialize_emu_ram(machine);
+        load_rom(machine, rom_path);
+        aot_emit(machine, rom_path, aot_output_path);
+        destroy_machine(machine);
+        printf("Wrote %s\n", aot_output_path);
+        return 0;
+    }
+
+    if (key_script_path != NULL) {
+        load_key_script(key_script_path);
+    }
+
+#ifdef __GNUC__
+    if (ENSEMBLE_SIZE > 0) {
+        run_ensemble_mode(rom_path);
+        return 0;
+    }
+#endif // __GNUC__
+
+    if (BENCH_MODE == 1) {
+        run_bench_mode(rom_path);
+        return 0;
+    }
+
+#ifndef HEADLESS
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
 		return EXIT_FAILURE;
@@ -928,6 +4354,14 @@ int main(int argc, char *argv[])
 	}
 
 
+    // limit presents to the display's refresh rate (assume 60Hz if it isn't known)
+    SDL_DisplayMode display_mode;
+    int refresh_rate = 60;
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(win), &display_mode) == 0 && display_mode.refresh_rate > 0) {
+        refresh_rate = display_mode.refresh_rate;
+    }
+    present_interval = NSEC_PER_SEC / refresh_rate;
+
     // create texture
     screen_tex = SDL_CreateTexture(
         screen_ren,
@@ -940,275 +4374,46 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // array of pixels of the screen
-    int pixel_array_size = SCREEN_WIDTH * SCREEN_HEIGHT * 4 * sizeof(uint8_t);
-    screen_pixels = malloc(pixel_array_size);
-    for (int y = 0; y < (SCREEN_HEIGHT); y++) {
-        for (int x = 0; x < SCREEN_WIDTH; x++) {
-            for(int rgba = 0; rgba < 4; rgba++) {
-                screen_pixels[(y * SCREEN_WIDTH * 4) + (x * 4) + rgba] = 0;
-                //count++;
-            }
-        }
-    }
-
-    initialize_emu_ram();
+    initialize_pixel_conversion();
+#endif // HEADLESS
 
-    load_rom(rom_path);
-    
+    Chip8Machine *machine = create_machine();
 
-    //Main loop flag
-    bool quit = false;
-
-    //Event handler
-    SDL_Event e;
-
-
-    struct timespec last_instruction;
-    get_clock_time(&last_instruction);
-    struct timespec current_instruction;
-
-
-    struct timespec ips_counter_last;
-    get_clock_time(&ips_counter_last);
-    struct timespec ips_counter_current;
-
-    struct timespec timer_last;
-    get_clock_time(&timer_last);
-    struct timespec timer_current;
-
-    struct timespec frame_last;
-    get_clock_time(&frame_last);
-    struct timespec frame_current;
-
-
-    int ips_count = 0;
-    int timer_count = 0;
-    int frame_count = 0;
-
-
-    draw_frame();
-
-    previous_keyboard = (uint8_t*) SDL_GetKeyboardState(NULL);
-
-
-	while(!quit) {
-        while (SDL_PollEvent( &e ) != 0) {
-            switch(e.type) {
-                case SDL_QUIT:
-                    quit = true;
-                    break;
-                case SDL_KEYDOWN:
-                    ;
-                    int temp_key = -1;
-                    // key down checks if key is already down because of keyspam
-                    if (e.key.keysym.scancode == SDL_SCANCODE_1 && keypad_states[0x1] == 0) { // 1
-                        keypad_states[0x1] = 1;
-                        temp_key = 0x1;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_2 && keypad_states[0x2] == 0) { // 2
-                        keypad_states[0x2] = 1;
-                        temp_key = 0x2;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_3 && keypad_states[0x3] == 0) { // 3
-                        keypad_states[0x3] = 1;
-                        temp_key = 0x3;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_4 && keypad_states[0xC] == 0) { // C
-                        keypad_states[0xC] = 1;
-                        temp_key = 0xC;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_Q && keypad_states[0x4] == 0) { // 4
-                        keypad_states[0x4] = 1;
-                        temp_key = 0x4;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_W && keypad_states[0x5] == 0) { // 5
-                        keypad_states[0x5] = 1;
-                        temp_key = 0x5;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_E && keypad_states[0x6] == 0) { // 6
-                        keypad_states[0x6] = 1;
-                        temp_key = 0x6;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_R && keypad_states[0xD] == 0) { // D
-                        keypad_states[0xD] = 1;
-                        temp_key = 0xD;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_A && keypad_states[0x7] == 0) { // 7
-                        keypad_states[0x7] = 1;
-                        temp_key = 0x7;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_S && keypad_states[0x8] == 0) { // 8
-                        keypad_states[0x8] = 1;
-                        temp_key = 0x8;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_D && keypad_states[0x9] == 0) { // 9
-                        keypad_states[0x9] = 1;
-                        temp_key = 0x9;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_F && keypad_states[0xE] == 0) { // E
-                        keypad_states[0xE] = 1;
-                        temp_key = 0xE;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_Z && keypad_states[0xA] == 0) { // A
-                        keypad_states[0xA] = 1;
-                        temp_key = 0xA;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_X && keypad_states[0x0] == 0) { // 0
-                        keypad_states[0x0] = 1;
-                        temp_key = 0x0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_C && keypad_states[0xB] == 0) { // B
-                        keypad_states[0xB] = 1;
-                        temp_key = 0xB;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_V && keypad_states[0xF] == 0) { // F
-                        keypad_states[0xF] = 1;
-                        temp_key = 0xF;
-                    }
-
-                    // set key for getkey instruction
-                    if (get_key_status == 1 && temp_key >= 0) {
-                        get_key_key = temp_key;
-                        get_key_status = 2;
-                    }
-                    break;
-                case SDL_KEYUP:
-                    // keyup does not check if key is down becuase keyup only ever fires once
-                    if (e.key.keysym.scancode == SDL_SCANCODE_1) {  // 1
-                        keypad_states[0x1] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_2) {  // 2
-                        keypad_states[0x2] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_3) { // 3
-                        keypad_states[0x3] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_4) { // C
-                        keypad_states[0xC] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_Q) { // 4
-                        keypad_states[0x4] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_W) { // 5
-                        keypad_states[0x5] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_E) { // 6
-                        keypad_states[0x6] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_R) { // D
-                        keypad_states[0xD] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_A) { // 7
-                        keypad_states[0x7] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_S) { // 8
-                        keypad_states[0x8] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_D) { // 9
-                        keypad_states[0x9] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_F) { // E
-                        keypad_states[0xE] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_Z) { // A
-                        keypad_states[0xA] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_X) { // 0
-                        keypad_states[0x0] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_C) { // B
-                        keypad_states[0xB] = 0;
-                    }
-                    else if (e.key.keysym.scancode == SDL_SCANCODE_V) { // F
-                        keypad_states[0xF] = 0;
-                    }
-                    break;
-                
-            }  
-        }
-
-        current_keyboard = (uint8_t*) SDL_GetKeyboardState(NULL);
-
-        // process changes
-        if (current_keyboard[SDL_SCANCODE_D] && !current_keyboard[SDL_SCANCODE_D]) {
-            printf("D pressed\n");
-        }
-
-        previous_keyboard = current_keyboard;
-
-        get_clock_time(&current_instruction);
-        struct timespec delta_time;
-        timespec_subtract(&delta_time, &current_instruction, &last_instruction);
-
-        // test timespec
-        struct timespec test_time_end;
-        struct timespec test_time_start;
-        test_time_end.tv_sec = 1676173113;
-        test_time_end.tv_nsec = 572109300;
-        test_time_start.tv_sec = 1676173112;
-        test_time_start.tv_nsec = 934113200;
-        struct timespec test_delta_time;
-        timespec_subtract(&test_delta_time, &test_time_end, & test_time_start);
-
-
-        // still only millisecond precision, so IPS can only be 500 or 1000
-        if(delta_time.tv_nsec >= ((long)1000000000 / IPS) || (long)delta_time.tv_sec >= 1) {
-            run_next_instruction();
-            get_clock_time(&last_instruction);
-            ips_count++;
-        }
-
-        get_clock_time(&ips_counter_current);
-        struct timespec delta_time_ips;
-        timespec_subtract(&delta_time_ips, &ips_counter_current, &ips_counter_last);
-
-
-        if ((long)delta_time_ips.tv_sec >= 1) {
-            printf("IPS: %d\n", ips_count);
-
-            get_clock_time(&ips_counter_last);
-            ips_count = 0;
-
-            printf("Timer: %d\n", timer_count);
-            timer_count = 0;
-
-            printf("FPS: %d\n", frame_count);
-            frame_count = 0;
-        }
-
-
-        get_clock_time(&timer_current);
-        struct timespec delta_time_timer;
-        timespec_subtract(&delta_time_timer, &timer_current, &timer_last);
+    initialize_emu_ram(machine);
 
+    load_program(machine, rom_path);
 
-        if(delta_time_timer.tv_nsec >= ((long)1000000000 / TIMER_FREQUENCY) || (long)delta_time_timer.tv_sec >= 1) {
-            update_timers();
-            get_clock_time(&timer_last);
-            timer_count++;
-        }
+    if (GOVERNOR == 1) {
+        // hashed before it runs, as it might change itself
+        governor_rom_hash = program_hash(machine);
+        int saved = load_governor_ips(governor_rom_hash);
+        IPS = clamp_ips((saved > 0) ? saved : IPS);
+        printf("Governor: starting at %d IPS%s\n", IPS, (saved > 0) ? " (saved for this ROM)" : "");
+    }
 
+    initialize_beep_wave();
+    if (wav_path != NULL) {
+        open_wav(wav_path);
+    }
 
+#ifdef HEADLESS
+    run_emulation(machine);
+#else
+    run_window(machine);
+#endif // HEADLESS
 
-        if (UNHOOK_FPS == 1) {
-            get_clock_time(&frame_current);
-            struct timespec delta_time_frame;
-            timespec_subtract(&delta_time_frame, &frame_current, &frame_last);
+    if (wav_file != NULL) {
+        close_wav();
+    }
 
-            
-            if(delta_time_frame.tv_nsec >= ((long)1000000000 / FPS) || (long)delta_time_frame.tv_sec >= 1) {
-                draw_frame();
-                get_clock_time(&frame_last);
-                frame_count++;
-            }
-        }
-	}
+	destroy_machine(machine);
 
+#ifndef HEADLESS
 	SDL_DestroyTexture(screen_tex);
 	SDL_DestroyRenderer(screen_ren);
 	SDL_DestroyWindow(win);
 	SDL_Quit();
+#endif // HEADLESS
 
 	return EXIT_SUCCESS;
 }
\ No newline at end of file